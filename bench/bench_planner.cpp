@@ -0,0 +1,402 @@
+#include <array>
+#include <string>
+#include <vector>
+#include <memory>
+#include <type_traits>
+#include <unordered_map>
+
+#include <benchmark/benchmark.h>
+#include <yaml-cpp/yaml.h>
+#include <spdlog/spdlog.h>
+
+#include "env.hpp"
+#include "utils.hpp"
+#include "vehicle.hpp"
+#include "vehicle_base.hpp"
+#include "planner.hpp"
+#include "scenario.hpp"
+
+static const std::vector<std::string> CONFIG_LIST =
+    {"unprotected_left_turn.yaml", "cross_straight.yaml", "triple_interact.yaml"};
+
+// Points the static planner parameters at `config`, its environment is built once per `key`.
+static const YAML::Node& initialize(const std::string& key, const YAML::Node& config) {
+    static std::unordered_map<std::string, std::shared_ptr<EnvCrossroads>> envs;
+    std::shared_ptr<EnvCrossroads>& env = envs[key];
+    if (!env) {
+        env = std::make_shared<EnvCrossroads>(config);
+    }
+    VehicleBase::initialize(env, 5, 2, 8, 2.4);
+    MonteCarloTreeSearch::initialize(config);
+    Node::initialize(config["max_step"].as<int>());
+    Random::seed(0);
+
+    return config;
+}
+
+// Loads a shipped config and points the static planner parameters at it.
+static const YAML::Node& setup(const std::string& config_name) {
+    static std::unordered_map<std::string, YAML::Node> configs;
+    auto iter = configs.find(config_name);
+    if (iter == configs.end()) {
+        iter = configs.emplace(config_name, YAML::LoadFile(std::string(BENCH_CONFIG_DIR) + "/" + config_name)).first;
+    }
+
+    return initialize(config_name, iter->second);
+}
+
+// the scaling runs search less, the curves matter rather than the absolute times
+static const uint64_t SCALING_BUDGET = 3000;
+
+// A generated scenario of `vehicles_num` vehicles around the last shipped config.
+static const YAML::Node& setup_scenario(int vehicles_num) {
+    static std::unordered_map<int, YAML::Node> scenarios;
+    auto iter = scenarios.find(vehicles_num);
+    if (iter == scenarios.end()) {
+        YAML::Node base = YAML::LoadFile(std::string(BENCH_CONFIG_DIR) + "/" + CONFIG_LIST.back());
+        base["computation_budget"] = SCALING_BUDGET;
+        iter = scenarios.emplace(vehicles_num, generate_scenario(base, ScenarioSpec{vehicles_num, {1, 1, 1}, 0})).first;
+    }
+
+    return initialize("scenario_" + std::to_string(vehicles_num), iter->second);
+}
+
+// The vehicles of a config at their initial states, the first one is the ego.
+static std::vector<VehicleBase> load_vehicles(const YAML::Node& config) {
+    std::vector<VehicleBase> vehicles;
+    for (const auto& yaml_node : config["vehicle_list"]) {
+        vehicles.emplace_back(Vehicle(yaml_node.first.as<std::string>(), config));
+    }
+
+    return vehicles;
+}
+
+static std::vector<StateList> static_prediction(const std::vector<VehicleBase>& others, int steps) {
+    std::vector<StateList> traj;
+    for (int i = 0; i < steps + 1; ++i) {
+        StateList states;
+        for (const VehicleBase& other : others) {
+            states.push_back(other.state);
+        }
+        traj.emplace_back(states);
+    }
+
+    return traj;
+}
+
+static void BM_HasOverlapPolygon(benchmark::State& bench_state) {
+    setup(CONFIG_LIST[0]);
+    Eigen::Matrix<double, 2, 5> box_0 = VehicleBase::get_box2d(State(0.0, 0.0, 0.3, 0.0));
+    Eigen::Matrix<double, 2, 5> box_1 = VehicleBase::get_box2d(State(3.0, 1.5, 1.2, 0.0));
+    for (auto _ : bench_state) {
+        benchmark::DoNotOptimize(utils::has_overlap(box_0, box_1));
+    }
+}
+BENCHMARK(BM_HasOverlapPolygon);
+
+static void BM_HasOverlapEnv(benchmark::State& bench_state) {
+    setup(CONFIG_LIST[0]);
+    Eigen::Matrix<double, 2, 5> box = VehicleBase::get_box2d(State(2.0, -12.0, M_PI_2, 0.0));
+    for (auto _ : bench_state) {
+        benchmark::DoNotOptimize(VehicleBase::env->is_offroad(box));
+        benchmark::DoNotOptimize(VehicleBase::env->is_on_laneline(box));
+    }
+}
+BENCHMARK(BM_HasOverlapEnv);
+
+// Offroad and laneline queries spread over a corridor of range(0) crossroads,
+// the cost of one should not grow with the tiles.
+static void BM_TiledEnvQueries(benchmark::State& bench_state) {
+    setup(CONFIG_LIST[0]);
+    std::vector<std::array<int, 2>> tiles;
+    for (int col = 0; col < bench_state.range(0); ++col) {
+        tiles.push_back({col, 0});
+    }
+    EnvCrossroads env(25.0, 4.0, 0.0, tiles);
+    // along the eastbound lane and across every junction
+    std::vector<Eigen::Matrix<double, 2, 5>> boxes;
+    for (int idx = 0; idx < 256; ++idx) {
+        double x = env.min_x() + (env.max_x() - env.min_x()) * (idx + 0.5) / 256;
+        boxes.push_back(VehicleBase::get_box2d(State(x, -2.0, 0.0, 0.0)));
+        boxes.push_back(VehicleBase::get_box2d(State(env.tile_x(idx % env.tiles_num()) + 2.0, x / 10, M_PI_2, 0.0)));
+    }
+    size_t idx = 0;
+    for (auto _ : bench_state) {
+        const Eigen::Matrix<double, 2, 5>& box = boxes[idx];
+        benchmark::DoNotOptimize(env.is_offroad(box));
+        benchmark::DoNotOptimize(env.is_on_laneline(box));
+        idx = (idx + 1) % boxes.size();
+    }
+}
+BENCHMARK(BM_TiledEnvQueries)->Arg(1)->Arg(4)->Arg(16)->Arg(64);
+
+// Offroad and laneline queries on a grid of range(0) cm, 0 runs SAT alone.
+// Every sampled box is first checked against SAT, the grid must agree on all.
+static void BM_GridEnvQueries(benchmark::State& bench_state) {
+    setup(CONFIG_LIST[0]);
+    CrossroadsTile exact(25.0, 4.0, 0.0);
+    CrossroadsTile grid(25.0, 4.0, bench_state.range(0) / 100.0);
+    std::vector<Eigen::Matrix<double, 2, 5>> boxes;
+    for (int idx = 0; idx < 20000; ++idx) {
+        double x = Random::uniform(-30.0, 30.0);
+        double y = Random::uniform(-30.0, 30.0);
+        boxes.push_back(VehicleBase::get_box2d(State(x, y, Random::uniform(-M_PI, M_PI), 0.0)));
+    }
+    int64_t touched = 0;
+    for (const Eigen::Matrix<double, 2, 5>& box : boxes) {
+        bool offroad = exact.is_offroad(box);
+        bool on_laneline = exact.is_on_laneline(box);
+        if (grid.is_offroad(box) != offroad || grid.is_on_laneline(box) != on_laneline) {
+            bench_state.SkipWithError("grid verdict differs from SAT");
+            return;
+        }
+        touched += offroad + on_laneline;
+    }
+    size_t idx = 0;
+    for (auto _ : bench_state) {
+        const Eigen::Matrix<double, 2, 5>& box = boxes[idx];
+        benchmark::DoNotOptimize(grid.is_offroad(box));
+        benchmark::DoNotOptimize(grid.is_on_laneline(box));
+        idx = (idx + 1) % boxes.size();
+    }
+    bench_state.counters["touched"] = static_cast<double>(touched) / (2 * boxes.size());
+}
+BENCHMARK(BM_GridEnvQueries)->Arg(0)->Arg(10)->Arg(25)->Arg(50);
+
+static void BM_HasOverlapObb(benchmark::State& bench_state) {
+    setup(CONFIG_LIST[0]);
+    OrientedBox box_0 = VehicleBase::get_obb(State(0.0, 0.0, 0.3, 0.0));
+    OrientedBox box_1 = VehicleBase::get_obb(State(3.0, 1.5, 1.2, 0.0));
+    for (auto _ : bench_state) {
+        benchmark::DoNotOptimize(utils::has_overlap(box_0, box_1));
+    }
+}
+BENCHMARK(BM_HasOverlapObb);
+
+static void BM_HasAnyOverlap(benchmark::State& bench_state) {
+    setup(CONFIG_LIST[0]);
+    OrientedBox ego = VehicleBase::get_safezone_obb(State(0.0, 0.0, 0.3, 0.0));
+    std::vector<OrientedBox> others;
+    for (int i = 0; i < bench_state.range(0); ++i) {
+        others.emplace_back(VehicleBase::get_safezone_obb(State(10.0 + i, 8.0, 1.2, 0.0)));
+    }
+    for (auto _ : bench_state) {
+        benchmark::DoNotOptimize(utils::has_any_overlap(ego, others.data(), others.size()));
+    }
+}
+BENCHMARK(BM_HasAnyOverlap)->Arg(1)->Arg(4)->Arg(8);
+
+static void BM_KinematicPropagate(benchmark::State& bench_state) {
+    State state(2.0, -20.0, M_PI_2, 4.0);
+    Eigen::Vector2d act = utils::get_action_value(Action::TURNLEFT);
+    for (auto _ : bench_state) {
+        benchmark::DoNotOptimize(utils::kinematic_propagate(state, act, 0.25));
+    }
+}
+BENCHMARK(BM_KinematicPropagate);
+
+static void BM_PropagateBatch(benchmark::State& bench_state) {
+    size_t size = bench_state.range(0);
+    std::vector<double> x(size, 2.0), y(size, -20.0), yaw(size, M_PI_2), v(size, 4.0);
+    std::vector<double> cos_yaw(size, cos(M_PI_2)), sin_yaw(size, sin(M_PI_2));
+    std::vector<Action> actions;
+    for (size_t k = 0; k < size; ++k) {
+        actions.push_back(ACTION_LIST[k % ACTION_NUM]);
+    }
+    StateBatch batch{x.data(), y.data(), yaw.data(), v.data(), cos_yaw.data(), sin_yaw.data(), size};
+    for (auto _ : bench_state) {
+        utils::propagate_batch(batch, actions.data(), 0.25);
+        benchmark::DoNotOptimize(x.data());
+    }
+    bench_state.SetItemsProcessed(bench_state.iterations() * size);
+}
+BENCHMARK(BM_PropagateBatch)->Arg(1)->Arg(64);
+
+static void BM_GetBox2d(benchmark::State& bench_state) {
+    setup(CONFIG_LIST[0]);
+    State state(2.0, -20.0, M_PI_2, 4.0);
+    for (auto _ : bench_state) {
+        benchmark::DoNotOptimize(VehicleBase::get_box2d(state));
+    }
+}
+BENCHMARK(BM_GetBox2d);
+
+static void BM_GetSafezone(benchmark::State& bench_state) {
+    setup(CONFIG_LIST[0]);
+    State state(2.0, -20.0, M_PI_2, 4.0);
+    for (auto _ : bench_state) {
+        benchmark::DoNotOptimize(VehicleBase::get_safezone(state));
+    }
+}
+BENCHMARK(BM_GetSafezone);
+
+static void BM_CalcCurValue(benchmark::State& bench_state) {
+    const YAML::Node& config = setup(CONFIG_LIST[2]);
+    std::vector<VehicleBase> vehicles = load_vehicles(config);
+    std::vector<VehicleBase> others(vehicles.begin() + 1, vehicles.end());
+    PredictionTable predictions(static_prediction(others, 1));
+    Node node(vehicles[0].state, 1, INVALID_NODE, Action::MAINTAIN, &predictions, vehicles[0].target);
+    for (auto _ : bench_state) {
+        benchmark::DoNotOptimize(MonteCarloTreeSearch::calc_cur_value(node, 0.0));
+    }
+}
+BENCHMARK(BM_CalcCurValue);
+
+// Reward of one node against `range(0)` agents spread over the crossroads,
+// the broad phase should keep the cost flat once most of them are far away.
+static void BM_CalcCurValueAgents(benchmark::State& bench_state) {
+    const YAML::Node& config = setup(CONFIG_LIST[2]);
+    std::vector<VehicleBase> vehicles = load_vehicles(config);
+    std::vector<VehicleBase> others;
+    for (int i = 0; i < bench_state.range(0); ++i) {
+        VehicleBase other = vehicles[1 + i % (vehicles.size() - 1)];
+        other.state.x = -24.0 + 48.0 * Random::uniform(0.0, 1.0);
+        other.state.y = -24.0 + 48.0 * Random::uniform(0.0, 1.0);
+        others.push_back(other);
+    }
+    PredictionTable predictions(static_prediction(others, 1));
+    Node node(vehicles[0].state, 1, INVALID_NODE, Action::MAINTAIN, &predictions, vehicles[0].target);
+    for (auto _ : bench_state) {
+        benchmark::DoNotOptimize(MonteCarloTreeSearch::calc_cur_value(node, 0.0));
+    }
+}
+BENCHMARK(BM_CalcCurValueAgents)->Arg(2)->Arg(8)->Arg(32)->Arg(128);
+
+static void BM_IsAnyCollision(benchmark::State& bench_state) {
+    const YAML::Node& config = setup(CONFIG_LIST[2]);
+    VehicleList vehicles;
+    for (int i = 0; i < bench_state.range(0); ++i) {
+        std::shared_ptr<Vehicle> vehicle = std::make_shared<Vehicle>("vehilce_0", config);
+        // a ring wide enough that no two boxes touch
+        double angle = 2 * M_PI * i / bench_state.range(0);
+        vehicle->state = State(bench_state.range(0) * cos(angle), bench_state.range(0) * sin(angle), angle, 0.0);
+        vehicles.push_back(vehicle);
+    }
+    for (auto _ : bench_state) {
+        benchmark::DoNotOptimize(vehicles.is_any_collision());
+    }
+}
+BENCHMARK(BM_IsAnyCollision)->Arg(3)->Arg(20)->Arg(100);
+
+using ShippedSearch = BasicMonteCarloTreeSearch<WeightedReward<ShippedWeights>>;
+
+// ShippedWeights copies the weight_* keys, they must not drift from any shipped config.
+static bool has_shipped_weights(const YAML::Node& config) {
+    return config["weight_avoid"].as<double>() == ShippedWeights::avoid() &&
+           config["weight_safe"].as<double>() == ShippedWeights::safe() &&
+           config["weight_offroad"].as<double>() == ShippedWeights::offroad() &&
+           config["weight_direction"].as<double>() == ShippedWeights::direction() &&
+           config["weight_distance"].as<double>() == ShippedWeights::distance() &&
+           config["weight_velocity"].as<double>() == ShippedWeights::velocity();
+}
+
+// Search = MonteCarloTreeSearch reads the weights of the config, the shipped
+// weights instantiation has them folded in at compile time.
+template <typename Search>
+static void BM_Excute(benchmark::State& bench_state) {
+    if (std::is_same<Search, ShippedSearch>::value) {
+        for (const std::string& config_name : CONFIG_LIST) {
+            if (!has_shipped_weights(setup(config_name))) {
+                bench_state.SkipWithError(("ShippedWeights differ from " + config_name).c_str());
+                return;
+            }
+        }
+    }
+    const YAML::Node& config = setup(CONFIG_LIST[2]);
+    std::vector<VehicleBase> vehicles = load_vehicles(config);
+    std::vector<VehicleBase> others(vehicles.begin() + 1, vehicles.end());
+    Search mcts(config);
+    std::vector<StateList> traj = static_prediction(others, config["max_step"].as<int>());
+    uint64_t budget = bench_state.range(0);
+    for (auto _ : bench_state) {
+        mcts.reset(traj);
+        NodeId root = mcts.tree.create(vehicles[0].state, 0, INVALID_NODE, Action::MAINTAIN,
+                                       &mcts.predictions, vehicles[0].target);
+        benchmark::DoNotOptimize(mcts.excute(root, budget));
+    }
+    bench_state.SetItemsProcessed(bench_state.iterations() * budget);
+}
+BENCHMARK_TEMPLATE(BM_Excute, MonteCarloTreeSearch)
+    ->Arg(1000)->Arg(5000)->Arg(15000)->Unit(benchmark::kMillisecond);
+BENCHMARK_TEMPLATE(BM_Excute, ShippedSearch)
+    ->Arg(1000)->Arg(5000)->Arg(15000)->Unit(benchmark::kMillisecond);
+
+static void BM_Planning(benchmark::State& bench_state, const std::string& config_name, int level) {
+    const YAML::Node& config = setup(config_name);
+    std::vector<VehicleBase> vehicles = load_vehicles(config);
+    VehicleBase ego = vehicles[0];
+    ego.level = level;
+    std::vector<VehicleBase> others(vehicles.begin() + 1, vehicles.end());
+    KLevelPlanner planner(config);
+    for (auto _ : bench_state) {
+        benchmark::DoNotOptimize(planner.planning(ego, others));
+    }
+}
+
+// One planning of a level range(1) ego among range(0) generated vehicles. With
+// range(2) the lower level predictions share a cache, range(3) > 1 runs them on
+// a pool of that many threads. Counters: the searches of a planning, the nodes
+// they create per second and the memory the node pools hold afterwards.
+static void BM_PlanningScaling(benchmark::State& bench_state) {
+    int vehicles_num = static_cast<int>(bench_state.range(0));
+    const YAML::Node& config = setup_scenario(vehicles_num);
+    std::vector<VehicleBase> vehicles = load_vehicles(config);
+    std::vector<VehicleBase> others(vehicles.begin() + 1, vehicles.end());
+    vehicles[0].level = static_cast<int>(bench_state.range(1));
+    WorldSnapshot world(vehicles[0], others);
+
+    KLevelPlanner planner(std::make_shared<PlanningContext>(config));
+    std::shared_ptr<PredictionCache> cache;
+    if (bench_state.range(2) != 0) {
+        cache = std::make_shared<PredictionCache>();
+    }
+    planner.set_prediction_cache(cache);
+    if (bench_state.range(3) > 1) {
+        planner.set_thread_pool(std::make_shared<ThreadPool>(static_cast<int>(bench_state.range(3))));
+    }
+
+    // one traced planning counts the searches, the timed ones run without the trace
+    std::shared_ptr<TraceRecorder> trace = std::make_shared<TraceRecorder>();
+    planner.set_trace(trace);
+    planner.planning(world, 0, 0);
+    size_t searches = 0;
+    SearchStats stats = trace->total(TraceCategory::SEARCH, &searches);
+    planner.set_trace(nullptr);
+
+    for (auto _ : bench_state) {
+        if (cache) {
+            cache->clear();
+        }
+        benchmark::DoNotOptimize(planner.planning(world, 0, 0));
+    }
+    bench_state.counters["searches"] = static_cast<double>(searches);
+    bench_state.counters["nodes/s"] = benchmark::Counter(static_cast<double>(stats.nodes_created),
+                                                         benchmark::Counter::kIsIterationInvariantRate);
+    bench_state.counters["arena_MB"] = planner.reserved_bytes() / 1e6;
+}
+BENCHMARK(BM_PlanningScaling)
+    ->ArgNames({"vehicles", "level", "cache", "threads"})
+    ->ArgsProduct({{2, 4, 8, 16}, {0, 1, 2}, {0, 1}, {1}})
+    ->ArgsProduct({{2, 4, 8, 16}, {1, 2}, {1}, {4}})
+    ->UseRealTime()
+    ->Unit(benchmark::kMillisecond);
+
+int main(int argc, char** argv) {
+    spdlog::set_level(spdlog::level::warn);
+    for (const std::string& config_name : CONFIG_LIST) {
+        for (int level = 0; level <= 2; ++level) {
+            std::string name = "BM_Planning/" + config_name.substr(0, config_name.find('.')) +
+                               "/level_" + std::to_string(level);
+            benchmark::RegisterBenchmark(name.c_str(), BM_Planning, config_name, level)
+                ->Unit(benchmark::kMillisecond);
+        }
+    }
+    benchmark::Initialize(&argc, argv);
+    if (benchmark::ReportUnrecognizedArguments(argc, argv)) {
+        return 1;
+    }
+    benchmark::RunSpecifiedBenchmarks();
+    benchmark::Shutdown();
+
+    return 0;
+}
@@ -0,0 +1,62 @@
+import json
+import argparse
+from collections import defaultdict
+
+import matplotlib.pyplot as plt
+
+
+# planning latency, node pool memory and search throughput of BM_PlanningScaling
+METRICS = [("real_time", "planning latency (ms)"), ("arena_MB", "node pools (MB)"),
+           ("nodes/s", "nodes created per second")]
+
+
+def load_runs(path:str) -> dict:
+    """The BM_PlanningScaling runs of a benchmark json, grouped by (level, cache, threads)."""
+    with open(path, 'r') as file:
+        report = json.load(file)
+
+    runs = defaultdict(list)
+    for bench in report["benchmarks"]:
+        if not bench["name"].startswith("BM_PlanningScaling/") or bench.get("run_type") == "aggregate":
+            continue
+        # BM_PlanningScaling/vehicles:8/level:2/cache:1/threads:4/real_time
+        args = dict(part.split(":") for part in bench["name"].split("/")[1:] if ":" in part)
+        key = (int(args["level"]), int(args["cache"]), int(args["threads"]))
+        runs[key].append((int(args["vehicles"]), bench))
+
+    return runs
+
+
+def plot(runs:dict, save_path:str) -> None:
+    fig, axes = plt.subplots(1, len(METRICS), figsize=(6 * len(METRICS), 4.5))
+    for (level, cache, threads), points in sorted(runs.items()):
+        points.sort(key=lambda point: point[0])
+        vehicles = [point[0] for point in points]
+        label = f"level {level}, {'cache' if cache else 'no cache'}, {threads} thread{'s' if threads > 1 else ''}"
+        for ax, (metric, _) in zip(axes, METRICS):
+            ax.plot(vehicles, [point[1][metric] for point in points], marker="o", label=label)
+
+    for ax, (metric, title) in zip(axes, METRICS):
+        ax.set_xlabel("vehicles")
+        ax.set_title(title)
+        ax.set_xscale("log", base=2)
+        if metric != "arena_MB":
+            ax.set_yscale("log")
+        ax.grid(True, which="both", alpha=0.3)
+    axes[0].legend(fontsize="small")
+    fig.tight_layout()
+
+    if save_path:
+        fig.savefig(save_path, dpi=150)
+    else:
+        plt.show()
+
+
+if __name__ == "__main__":
+    parser = argparse.ArgumentParser(
+        description="Plots ./bench --benchmark_filter=BM_PlanningScaling --benchmark_out=scaling.json")
+    parser.add_argument("report", type=str, help="benchmark json written by --benchmark_out")
+    parser.add_argument("-o", "--output", type=str, default="", help="save the figure instead of showing it")
+    args = parser.parse_args()
+
+    plot(load_runs(args.report), args.output)
@@ -2,15 +2,39 @@
 #ifndef __ENV_HPP
 #define __ENV_HPP
 
+#include <array>
 #include <vector>
+#include <cstdint>
 #include <Eigen/Core>
+#include <yaml-cpp/yaml.h>
 
-class EnvCrossroads {
+enum class LaneDirection : int8_t {NONE, DOWN, UP, RIGHT, LEFT};
+
+// One four-way intersection centered at the origin: the four corner blocks
+// beside the roads, the center lines and the lane directions, out to
+// `map_size` from the center.
+class CrossroadsTile {
 private:
+    // rasterized lookups, sampled at the cell corners of a grid covering the tile plus a margin
+    int grid_cols;
+    int grid_rows;
+    double grid_origin;
+    double grid_inv_resolution;
+    std::vector<float> offroad_field;   // signed distance to rect, negative inside
+    std::vector<float> laneline_field;  // distance to laneline
+    std::vector<LaneDirection> lane_direction_grid;
+
+    double calc_offroad_distance(double x, double y) const;
+    double calc_laneline_distance(double x, double y) const;
+    LaneDirection calc_lane_direction(double x, double y) const;
+    double sample_field(const std::vector<float>& field, double x, double y, bool& in_grid) const;
+    template <typename DistanceFunc, typename ExactFunc>
+    bool is_box_touched(const Eigen::Matrix<double, 2, 5>& box2d, DistanceFunc distance, ExactFunc exact) const;
 
 public:
     double map_size;
     double lanewidth;
+    double grid_resolution;
 
     std::vector<std::vector<std::vector<double>>> rect;
     std::vector<std::vector<std::vector<double>>> laneline;
@@ -18,9 +42,75 @@ public:
     std::vector<Eigen::MatrixXd> rect_mat;
     std::vector<Eigen::MatrixXd> laneline_mat;
 
-    EnvCrossroads(double size = 25.0, double width = 4.0);
+    CrossroadsTile(double size = 25.0, double width = 4.0, double resolution = 0.0);
+    ~CrossroadsTile() {}
+
+    // With resolution > 0 the baked grid clears the boxes well away from a boundary
+    // and the rest run SAT, so the verdicts are those of the SAT tests either way.
+    bool has_grid(void) const { return !offroad_field.empty(); }
+    bool is_offroad(const Eigen::Matrix<double, 2, 5>& box2d) const;
+    bool is_on_laneline(const Eigen::Matrix<double, 2, 5>& box2d) const;
+    bool is_offroad_exact(const Eigen::Matrix<double, 2, 5>& box2d) const;
+    bool is_on_laneline_exact(const Eigen::Matrix<double, 2, 5>& box2d) const;
+    LaneDirection get_lane_direction(double x, double y) const;
+};
+
+// Crossroads side by side on a grid of tiles 2 * map_size wide, the roads of
+// neighbouring tiles meet at their shared edge. Every tile has the geometry
+// of one CrossroadsTile, moved to its cell. The tile grid indexes that
+// geometry: a query only runs on the tiles under the box, at most four, so it
+// costs the same on any map. Outside the grid the nearest tiles carry on, a
+// cell of the grid without a tile is offroad.
+class EnvCrossroads {
+private:
+    CrossroadsTile tile;
+    // [column, row] of every tile, the tile of column c, row r is centered at (c, r) * pitch
+    std::vector<std::array<int, 2>> tiles;
+    double pitch;
+    int min_col;
+    int min_row;
+    int cols;
+    int rows;
+    // tile of every cell of the grid spanned by the tiles, row major, -1 where there is none
+    std::vector<int32_t> tile_grid;
+
+    void index_tiles(void);
+    int col_of(double x) const;
+    int row_of(double y) const;
+    // `query` on the tiles under the box, a cell without a tile counts as touched if `empty_touched`
+    template <typename TileQuery>
+    bool is_any_tile_touched(const Eigen::Matrix<double, 2, 5>& box2d, TileQuery query, bool empty_touched) const;
+
+public:
+    double map_size;
+    double lanewidth;
+    double grid_resolution;
+
+    EnvCrossroads(double size = 25.0, double width = 4.0, double resolution = 0.0,
+                  const std::vector<std::array<int, 2>>& _tiles = {{0, 0}});
+    // map_size, lane_width, grid_resolution and map_tiles of the config
+    explicit EnvCrossroads(const YAML::Node& cfg);
     ~EnvCrossroads() {}
+    // defined with the renderer, the planner library does not draw
     void draw_env(void);
+
+    bool has_grid(void) const { return tile.has_grid(); }
+    size_t tiles_num(void) const { return tiles.size(); }
+    const std::vector<std::array<int, 2>>& tile_cells(void) const { return tiles; }
+    // center of tile `idx`
+    double tile_x(size_t idx) const { return tiles[idx][0] * pitch; }
+    double tile_y(size_t idx) const { return tiles[idx][1] * pitch; }
+    // bounding box of all tiles
+    double min_x(void) const { return min_col * pitch - map_size; }
+    double max_x(void) const { return (min_col + cols - 1) * pitch + map_size; }
+    double min_y(void) const { return min_row * pitch - map_size; }
+    double max_y(void) const { return (min_row + rows - 1) * pitch + map_size; }
+    // on one of the tiles
+    bool contains(double x, double y) const;
+
+    bool is_offroad(const Eigen::Matrix<double, 2, 5>& box2d) const;
+    bool is_on_laneline(const Eigen::Matrix<double, 2, 5>& box2d) const;
+    LaneDirection get_lane_direction(double x, double y) const;
 };
 
 
@@ -2,14 +2,82 @@
 #ifndef __PLANNER_HPP
 #define __PLANNER_HPP
 
+#include <array>
+#include <cmath>
+#include <chrono>
+#include <mutex>
+#include <memory>
+#include <future>
+#include <string>
+#include <functional>
+#include <unordered_map>
 #include <yaml-cpp/yaml.h>
+#include <spdlog/spdlog.h>
 
 #include "utils.hpp"
 #include "vehicle_base.hpp"
+#include "thread_pool.hpp"
+#include "trace.hpp"
+#include "world.hpp"
 
-class MonteCarloTreeSearch {
+// ROOT: every worker grows its own tree, the trees are merged at the end.
+// TREE: all workers share one tree and steer apart with a virtual loss.
+enum class ParallelMode {ROOT, TREE};
+
+// Searches stop at the deadline, Deadline::max() runs the whole budget.
+using Deadline = std::chrono::steady_clock::time_point;
+
+// Boxes and safezones of the other agents at every step of the horizon, built
+// once per search. Nodes share one table and look their step up by cur_level.
+// Each step keeps its agents sorted by x, so a query only hands the agents
+// whose x extent reaches the ego's to the overlap tests (sweep and prune).
+class PredictionTable {
 private:
-    /* data */
+    // below this many agents one overlap pass over all of them is cheaper than the search
+    static constexpr size_t BROAD_PHASE_MIN_AGENTS = 8;
+
+    size_t agents_num;
+    size_t steps_num;
+    std::vector<OrientedBox> boxes;
+    std::vector<OrientedBox> safezones;
+    // center x of every box, and the widest box and safezone x extents of each step
+    std::vector<double> centers_x;
+    std::vector<double> box_reach;
+    std::vector<double> safezone_reach;
+
+    BoxSpan near(const std::vector<OrientedBox>& list, double reach, int level, const OrientedBox& box) const;
+public:
+    PredictionTable() : agents_num(0), steps_num(0) {}
+    explicit PredictionTable(const std::vector<StateList>& traj) : agents_num(0), steps_num(0) {
+        assign(traj);
+    }
+
+    // rebuilds the table for `traj` in the buffers of the last one
+    void assign(const std::vector<StateList>& traj);
+
+    size_t agents(void) const {
+        return agents_num;
+    }
+    size_t steps(void) const {
+        return steps_num;
+    }
+    const OrientedBox* boxes_at(int level) const {
+        return boxes.data() + level * agents_num;
+    }
+    const OrientedBox* safezones_at(int level) const {
+        return safezones.data() + level * agents_num;
+    }
+    // the boxes at `level` that may overlap `box`, the others are apart along x
+    BoxSpan near_boxes(int level, const OrientedBox& box) const {
+        return near(boxes, box_reach[level], level, box);
+    }
+    BoxSpan near_safezones(int level, const OrientedBox& safezone) const {
+        return near(safezones, safezone_reach[level], level, safezone);
+    }
+};
+
+// Parameters and reward terms shared by every instantiation of the search.
+class MonteCarloTreeSearchBase {
 public:
     static double EXPLORATE_RATE;
     static double LAMDA;
@@ -19,59 +87,357 @@ public:
     static double WEIGHT_DIRECTION;
     static double WEIGHT_DISTANCE;
     static double WEIGHT_VELOCITY;
+    // DISCOUNT[k] = LAMDA^k
+    static constexpr int DISCOUNT_TABLE_SIZE = 64;
+    static std::array<double, DISCOUNT_TABLE_SIZE> DISCOUNT;
+
+    static void initialize(const YAML::Node& cfg) {
+        MonteCarloTreeSearchBase::LAMDA = cfg["lamda"].as<double>();
+        MonteCarloTreeSearchBase::WEIGHT_AVOID = cfg["weight_avoid"].as<double>();
+        MonteCarloTreeSearchBase::WEIGHT_SAFE = cfg["weight_safe"].as<double>();
+        MonteCarloTreeSearchBase::WEIGHT_OFFROAD = cfg["weight_offroad"].as<double>();
+        MonteCarloTreeSearchBase::WEIGHT_DIRECTION = cfg["weight_direction"].as<double>();
+        MonteCarloTreeSearchBase::WEIGHT_DISTANCE = cfg["weight_distance"].as<double>();
+        MonteCarloTreeSearchBase::WEIGHT_VELOCITY = cfg["weight_velocity"].as<double>();
+        for (int k = 0; k < DISCOUNT_TABLE_SIZE; ++k) {
+            MonteCarloTreeSearchBase::DISCOUNT[k] = pow(MonteCarloTreeSearchBase::LAMDA, k);
+        }
+    }
+    static double discount(int level) {
+        return level < DISCOUNT_TABLE_SIZE ? DISCOUNT[level] : pow(MonteCarloTreeSearchBase::LAMDA, level);
+    }
+    static bool is_opposite_direction(const State& pos, const Eigen::Matrix<double, 2, 5>& ego_box2d);
+    // value and reward with the weights of the config
+    static double calc_cur_value(Node& node, double last_node_value);
+    static double calc_cur_reward(const State& state, const State& goal, const PredictionTable& others, int level);
+};
 
-    VehicleBase ego_vehicle;
-    std::vector<VehicleBase> other_vehicles;
-    std::vector<StateList> other_predict_traj;
+// Search parameters of the config, parsed once.
+struct SearchParams {
     uint64_t computation_budget;
     double dt;
+    int search_threads;
+    ParallelMode parallel_mode;
+    double virtual_loss;
+    double reuse_decay;
+    double widening_coeff;
+    double widening_exponent;
+    // rollouts stepped together from every new leaf, each backed up as one visit
+    int leaf_rollouts;
+    static constexpr int MAX_LEAF_ROLLOUTS = 16;
+    // cells of the transposition table, x, y and v share one size, 0 keeps a tree
+    double transposition_resolution;
+    double transposition_yaw_resolution;
 
-    MonteCarloTreeSearch(const VehicleBase& ego, const std::vector<VehicleBase>& others,
-                 const std::vector<StateList>& other_traj, const YAML::Node& cfg) :
-                 ego_vehicle(ego), other_vehicles(others), other_predict_traj(other_traj) {
-        computation_budget = cfg["computation_budget"].as<uint64_t>();
-        dt = cfg["delta_t"].as<double>();
+    static SearchParams from_yaml(const YAML::Node& cfg);
+};
+
+// Reward weights of the config, set by MonteCarloTreeSearchBase::initialize().
+struct ConfigWeights {
+    static double avoid(void) { return MonteCarloTreeSearchBase::WEIGHT_AVOID; }
+    static double safe(void) { return MonteCarloTreeSearchBase::WEIGHT_SAFE; }
+    static double offroad(void) { return MonteCarloTreeSearchBase::WEIGHT_OFFROAD; }
+    static double direction(void) { return MonteCarloTreeSearchBase::WEIGHT_DIRECTION; }
+    static double distance(void) { return MonteCarloTreeSearchBase::WEIGHT_DISTANCE; }
+    static double velocity(void) { return MonteCarloTreeSearchBase::WEIGHT_VELOCITY; }
+};
+
+// Weights of the shipped configs as compile time constants, BM_Excute checks
+// them against the configs it runs.
+struct ShippedWeights {
+    static constexpr double avoid(void) { return 20; }
+    static constexpr double safe(void) { return 0.2; }
+    static constexpr double offroad(void) { return 2; }
+    static constexpr double direction(void) { return 1; }
+    static constexpr double distance(void) { return 0.1; }
+    static constexpr double velocity(void) { return 0.05; }
+};
+
+// Reward of one state against the other agents at `level`.
+template <typename Weights>
+struct WeightedReward {
+    double operator()(const State& state, const State& goal, const PredictionTable& others, int level) const {
+        return (*this)(state, cos(state.yaw), sin(state.yaw), goal, others, level);
     }
-    ~MonteCarloTreeSearch() {}
+    // cos_yaw/sin_yaw of state.yaw, as kept by the propagation batches
+    double operator()(const State& state, double cos_yaw, double sin_yaw,
+                      const State& goal, const PredictionTable& others, int level) const;
+};
 
-    static void initialize(const YAML::Node& cfg) {
-        MonteCarloTreeSearch::LAMDA = cfg["lamda"].as<double>();
-        MonteCarloTreeSearch::WEIGHT_AVOID = cfg["weight_avoid"].as<double>();
-        MonteCarloTreeSearch::WEIGHT_SAFE = cfg["weight_safe"].as<double>();
-        MonteCarloTreeSearch::WEIGHT_OFFROAD = cfg["weight_offroad"].as<double>();
-        MonteCarloTreeSearch::WEIGHT_DIRECTION = cfg["weight_direction"].as<double>();
-        MonteCarloTreeSearch::WEIGHT_DISTANCE = cfg["weight_distance"].as<double>();
-        MonteCarloTreeSearch::WEIGHT_VELOCITY = cfg["weight_velocity"].as<double>();
-    }
-    static bool is_opposite_direction(State pos, Eigen::MatrixXd ego_box2d);
-    static double calc_cur_value(std::shared_ptr<Node> node, double last_node_value);
-
-    std::shared_ptr<Node> excute(std::shared_ptr<Node> root);
-    std::shared_ptr<Node> tree_policy(std::shared_ptr<Node> node);
-    std::shared_ptr<Node> expand(std::shared_ptr<Node> node);
-    std::shared_ptr<Node> get_best_child(std::shared_ptr<Node> node, double scalar);
-    double default_policy(std::shared_ptr<Node> node);
-    void update(std::shared_ptr<Node> node, double r);
+using ConfigReward = WeightedReward<ConfigWeights>;
+
+// The reward is a template parameter so the search inlines it. Member
+// definitions are in planner.cpp, which instantiates the rewards declared below.
+template <typename Reward = ConfigReward>
+class BasicMonteCarloTreeSearch : public MonteCarloTreeSearchBase {
+private:
+    Reward reward_func;
+    std::vector<NodePool> worker_trees;
+    NodePool reuse_tree;
+
+    void search(NodePool& pool, NodeId root, uint64_t budget, Deadline deadline, SearchStats& search_stats);
+    void root_parallel_search(NodeId root, uint64_t total_budget, Deadline deadline);
+    void tree_parallel_search(NodeId root, uint64_t budget, Deadline deadline);
+    // `helpers` run as tasks of thread_pool while the calling thread runs `own`, without a pool they run after it
+    void run_beside(std::vector<std::function<void(void)>>& helpers, const std::function<void(void)>& own);
+    void measure_shape(NodeId root);
+    void merge_tree(NodePool& dst, NodeId dst_id, const NodePool& src, NodeId src_id);
+    void apply_virtual_loss(NodePool& pool, NodeId node, bool revert);
+    double copy_subtree(NodeId src_id, NodeId dst_parent, int level_offset, double value_offset);
+public:
+    NodePool tree;
+    PredictionTable predictions;
+    uint64_t computation_budget;
+    double dt;
+    int search_threads;
+    ParallelMode parallel_mode;
+    double virtual_loss;
+    double reuse_decay;
+    // progressive widening, a node visited n times has at most ceil(coeff * n^exponent) children
+    double widening_coeff;
+    double widening_exponent;
+    int leaf_rollouts;
+    // counters of the last excute(), profile adds the shape of the tree and the phase times
+    SearchStats stats;
+    bool profile;
+    // runs the other search_threads - 1 parts of a parallel search, not owned
+    ThreadPool* thread_pool;
+
+    BasicMonteCarloTreeSearch() : computation_budget(0), dt(0), search_threads(1),
+                                  parallel_mode(ParallelMode::ROOT), virtual_loss(1.0), reuse_decay(1.0),
+                                  widening_coeff(0.0), widening_exponent(0.5), leaf_rollouts(1), profile(false),
+                                  thread_pool(nullptr) {}
+    BasicMonteCarloTreeSearch(const YAML::Node& cfg) : BasicMonteCarloTreeSearch(SearchParams::from_yaml(cfg)) {}
+    explicit BasicMonteCarloTreeSearch(const SearchParams& params) :
+        computation_budget(params.computation_budget), dt(params.dt), search_threads(params.search_threads),
+        parallel_mode(params.parallel_mode), virtual_loss(params.virtual_loss), reuse_decay(params.reuse_decay),
+        widening_coeff(params.widening_coeff), widening_exponent(params.widening_exponent),
+        leaf_rollouts(params.leaf_rollouts), profile(false),
+        thread_pool(nullptr) {
+        // every iteration adds at most one node to the tree
+        tree.reserve(computation_budget + 1);
+        tree.enable_transpositions(params.transposition_resolution, params.transposition_yaw_resolution);
+        reuse_tree.enable_transpositions(params.transposition_resolution, params.transposition_yaw_resolution);
+        if (parallel_mode == ParallelMode::ROOT && search_threads > 1) {
+            worker_trees.resize(search_threads - 1);
+            for (NodePool& pool : worker_trees) {
+                pool.reserve(computation_budget / search_threads + 2);
+                pool.enable_transpositions(params.transposition_resolution, params.transposition_yaw_resolution);
+            }
+        }
+    }
+    ~BasicMonteCarloTreeSearch() {}
+
+    // memory held by the node pools of the search
+    size_t reserved_bytes(void) const {
+        size_t bytes = tree.reserved_bytes() + reuse_tree.reserved_bytes();
+        for (const NodePool& pool : worker_trees) {
+            bytes += pool.reserved_bytes();
+        }
+        return bytes;
+    }
+
+    double calc_value(Node& node, double last_node_value) const {
+        node.value = last_node_value + MonteCarloTreeSearchBase::discount(node.cur_level - 1) *
+                     reward_func(node.state, node.cos_yaw, node.sin_yaw, node.goal_pose, *node.predictions,
+                                 node.cur_level);
+        return node.value;
+    }
 
+    void reset(const std::vector<StateList>& other_traj);
+    NodeId reroot(NodeId node, const std::vector<StateList>& other_traj);
+    NodeId excute(NodeId root) { return excute(root, computation_budget); }
+    // at most `budget` iterations, fewer if the deadline comes first
+    NodeId excute(NodeId root, uint64_t budget, Deadline deadline = Deadline::max());
+    int widening_limit(int visits) const {
+        return static_cast<int>(ceil(widening_coeff * pow(std::max(visits, 1), widening_exponent)));
+    }
+    NodeId tree_policy(NodePool& pool, NodeId node);
+    NodeId expand(NodePool& pool, NodeId node);
+    NodeId get_best_child(NodeId node, double scalar) { return get_best_child(tree, node, scalar); }
+    NodeId get_best_child(const NodePool& pool, NodeId node, double scalar);
+    // sum of the values of leaf_rollouts rollouts from `node`
+    double default_policy(const Node& node);
+    void update(NodePool& pool, NodeId node, int visits, double r);
+};
+
+extern template struct WeightedReward<ConfigWeights>;
+extern template struct WeightedReward<ShippedWeights>;
+extern template class BasicMonteCarloTreeSearch<ConfigReward>;
+extern template class BasicMonteCarloTreeSearch<WeightedReward<ShippedWeights>>;
+
+using MonteCarloTreeSearch = BasicMonteCarloTreeSearch<>;
+
+struct PredictionKey {
+    size_t name_hash;
+    int level;
+    size_t state_hash;
+
+    bool operator==(const PredictionKey& other) const {
+        return level == other.level && state_hash == other.state_hash && name_hash == other.name_hash;
+    }
+};
+
+struct PredictionKeyHash {
+    size_t operator()(const PredictionKey& key) const;
+};
+
+// Lower level predictions shared by all planners of one simulation step.
+// Each (agent, level, world state) sub-problem is solved once, concurrent
+// requests for the same key wait for the planner that got there first.
+class PredictionCache {
+private:
+    std::mutex mutex;
+    std::unordered_map<PredictionKey, std::shared_future<StateList>, PredictionKeyHash> entries;
+    uint64_t hits;
+    uint64_t misses;
+public:
+    PredictionCache() : hits(0), misses(0) {}
+    ~PredictionCache() {}
+
+    StateList get_or_compute(const PredictionKey& key, const std::function<StateList(void)>& compute);
+    void clear(void);
+    uint64_t hit_count(void);
+    uint64_t miss_count(void);
+};
+
+// Planner parameters of the config, parsed once.
+struct PlannerParams {
+    int steps;
+    double dt;
+    double planning_deadline_ms;
+    bool tree_reuse;
+    double reuse_budget_ratio;
+    double reuse_tolerance;
+    SearchParams search;
+
+    static PlannerParams from_yaml(const YAML::Node& cfg);
+};
+
+// What planning needs besides the world, set up once: the parameters and the
+// searches of the lower level predictions, whose node pools and prediction
+// tables keep their capacity from one call to the next. The planners of a
+// simulation may share a context, a prediction borrows an idle search and
+// hands it back, so there are only as many searches as ever ran at once.
+class PlanningContext {
+private:
+    PlannerParams params;
+    std::mutex mutex;
+    std::vector<std::unique_ptr<MonteCarloTreeSearch>> idle_searches;
+    size_t searches_num;
+public:
+    explicit PlanningContext(const PlannerParams& _params) : params(_params), searches_num(0) {}
+    explicit PlanningContext(const YAML::Node& cfg) : PlanningContext(PlannerParams::from_yaml(cfg)) {}
+    ~PlanningContext() {}
+
+    const PlannerParams& parameters(void) const {
+        return params;
+    }
+    std::unique_ptr<MonteCarloTreeSearch> acquire_search(void);
+    void release_search(std::unique_ptr<MonteCarloTreeSearch> search);
+    // searches built so far, idle or borrowed
+    size_t searches_created(void);
+    // memory held by the node pools of the idle searches
+    size_t reserved_bytes(void);
 };
 
 class KLevelPlanner {
 private:
     int steps;
     double dt;
-    YAML::Node config;
+    std::shared_ptr<PlanningContext> context;
+    MonteCarloTreeSearch mcts;
+    std::shared_ptr<PredictionCache> prediction_cache;
+    std::shared_ptr<ThreadPool> thread_pool;
+    // warm start of the ego search, the lower level searches always start cold
+    bool tree_reuse;
+    double reuse_budget_ratio;
+    double reuse_tolerance;
+    MonteCarloTreeSearch ego_mcts;
+    NodeId reuse_node;
+    // anytime mode, 0 runs the whole computation_budget
+    double planning_deadline_ms;
+    uint64_t iterations;
+    std::shared_ptr<TraceRecorder> trace;
+    // the vehicle of the running planning(), names the spans of its recursion
+    std::string owner;
+    // every search of the running planning() draws from a stream below this seed
+    uint64_t step_seed;
+
+    void record_search(const std::string& subject, int level, const MonteCarloTreeSearch& search, int64_t start_us);
+
+    std::pair<std::vector<Action>, StateList> extract_path(MonteCarloTreeSearch& search, NodeId root,
+        uint64_t budget, Deadline deadline, NodeId* first_node = nullptr);
+    bool can_reuse(const State& state);
+    std::pair<std::vector<Action>, StateList> forward_simulate(MonteCarloTreeSearch& search,
+        const State& state, const State& target, const std::vector<StateList>& traj, Deadline deadline);
+    // what agent `other_id` does, planned one level below `level` against all the other agents
+    StateList predict_other(const WorldSnapshot& world, int level, int other_id, Deadline deadline);
 public:
-    KLevelPlanner() {}
-    KLevelPlanner(const YAML::Node& cfg) : config(cfg) {
-        steps = cfg["max_step"].as<int>();
-        dt = cfg["delta_t"].as<double>();
+    // a planner always plans with a context, there is none to default to
+    KLevelPlanner() = delete;
+    KLevelPlanner(const YAML::Node& cfg) : KLevelPlanner(std::make_shared<PlanningContext>(cfg)) {}
+    explicit KLevelPlanner(std::shared_ptr<PlanningContext> _context) :
+        context(_context), mcts(_context->parameters().search), reuse_node(INVALID_NODE), iterations(0),
+        step_seed(0) {
+        const PlannerParams& params = context->parameters();
+        steps = params.steps;
+        dt = params.dt;
+        planning_deadline_ms = params.planning_deadline_ms;
+        tree_reuse = params.tree_reuse;
+        reuse_budget_ratio = params.reuse_budget_ratio;
+        reuse_tolerance = params.reuse_tolerance;
+        if (tree_reuse) {
+            ego_mcts = MonteCarloTreeSearch(params.search);
+        }
     }
     ~KLevelPlanner() {}
 
-    std::pair<Action, StateList> planning(const VehicleBase& ego, const std::vector<VehicleBase>& others);
-    std::pair<std::vector<Action>, StateList> forward_simulate(
-        const VehicleBase& ego, const std::vector<VehicleBase>& others, const std::vector<StateList>& traj);
-    std::vector<StateList> get_prediction(const VehicleBase& ego, const std::vector<VehicleBase>& others);
+    void reset(void) {
+        reuse_node = INVALID_NODE;
+    }
+
+    void set_prediction_cache(std::shared_ptr<PredictionCache> cache) {
+        prediction_cache = cache;
+    }
+
+    // lower level predictions and the parts of parallel searches run as pool tasks,
+    // without a pool they run in order
+    void set_thread_pool(std::shared_ptr<ThreadPool> pool) {
+        thread_pool = pool;
+        mcts.thread_pool = pool.get();
+        ego_mcts.thread_pool = pool.get();
+    }
+
+    // records every planning, prediction and search into the trace, nullptr stops
+    void set_trace(std::shared_ptr<TraceRecorder> recorder) {
+        trace = recorder;
+    }
+
+    // iterations the ego search of the last planning() ran
+    uint64_t get_iterations(void) const {
+        return iterations;
+    }
+
+    // memory held by the node pools of the planner and of its context
+    size_t reserved_bytes(void) const {
+        return mcts.reserved_bytes() + ego_mcts.reserved_bytes() + context->reserved_bytes();
+    }
+
+    std::pair<Action, StateList> planning(const VehicleBase& ego, const std::vector<VehicleBase>& others) {
+        return planning(WorldSnapshot(ego, others), 0, Random::draw_seed());
+    }
+    // Plans agent `ego_id` of the world against all the others. Vehicles planning the
+    // same step pass the same seed. A prediction draws from a stream of its cache
+    // key, so it comes out the same whoever computes it.
+    std::pair<Action, StateList> planning(const WorldSnapshot& world, int ego_id, uint64_t seed);
+    // the plan of `ego` against the predicted trajectories `traj` of the other agents
+    std::pair<std::vector<Action>, StateList> forward_simulate(const VehicleBase& ego,
+                                                               const std::vector<StateList>& traj);
+    // What the agents other than `ego_id` do, as a level `level` ego expects it, in
+    // id order. The searches of the lower levels share the time left until the deadline.
+    std::vector<StateList> get_prediction(const WorldSnapshot& world, int ego_id, int level,
+                                          Deadline deadline = Deadline::max());
 };
 
 
@@ -0,0 +1,80 @@
+#pragma once
+#ifndef __RENDERER_HPP
+#define __RENDERER_HPP
+
+#include <deque>
+#include <mutex>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+#include <filesystem>
+#include <condition_variable>
+
+#include "utils.hpp"
+#include "env.hpp"
+#include "vehicle.hpp"
+
+// What the plot of one vehicle needs, copied out of the simulation.
+struct VehicleFrame {
+    std::string name;
+    std::string color;
+    int level;
+    State state;
+    State target;
+    State text_pos;
+    Action action;
+    StateList excepted_traj;
+    // round summaries only
+    std::vector<State> footprint;
+};
+
+// A step draws the current states and plans, a round summary draws the
+// footprints of the whole round and may be saved as a figure.
+struct Frame {
+    enum class Kind {STEP, ROUND_SUMMARY};
+
+    Kind kind;
+    int round;
+    int rounds_num;
+    std::vector<VehicleFrame> vehicles;
+
+    // a round summary draws `footprints`, the states every vehicle moved through in the round
+    static Frame capture(Kind kind, VehicleList& vehicles, int round, int rounds_num,
+                         const std::vector<std::vector<State>>& footprints = {});
+};
+
+// Draws frames on its own thread, so the simulation only pays for the copy.
+// Matplotlib is only ever called from that thread. When the renderer falls
+// behind, the oldest step frames are dropped; round summaries are always drawn.
+class FrameRenderer {
+private:
+    // the figure spans every tile of the map
+    std::shared_ptr<EnvCrossroads> env;
+    bool save_fig;
+    std::filesystem::path save_path;
+    size_t max_pending;
+
+    std::mutex mutex;
+    std::condition_variable cond;
+    std::deque<Frame> frames;
+    bool stop;
+    uint64_t dropped;
+    std::thread worker;
+
+    void render_loop(void);
+    void draw_step(const Frame& frame);
+    void draw_summary(const Frame& frame);
+public:
+    FrameRenderer(std::shared_ptr<EnvCrossroads> _env, bool _save_fig,
+                  std::filesystem::path _save_path, size_t _max_pending = 8);
+    // draws the frames still queued before it returns
+    ~FrameRenderer();
+    FrameRenderer(const FrameRenderer&) = delete;
+    FrameRenderer& operator=(const FrameRenderer&) = delete;
+
+    void push(Frame&& frame);
+    uint64_t dropped_count(void);
+};
+
+#endif
@@ -0,0 +1,24 @@
+#pragma once
+#ifndef __SCENARIO_HPP
+#define __SCENARIO_HPP
+
+#include <vector>
+#include <cstdint>
+#include <yaml-cpp/yaml.h>
+
+// What a generated crossroads scenario looks like.
+struct ScenarioSpec {
+    int vehicles_num;
+    // relative weights of levels 0, 1, 2, the level counts follow them as closely as whole vehicles can
+    std::vector<double> level_mix;
+    uint64_t seed;
+};
+
+// The config `base` with its vehicle list replaced by `spec.vehicles_num`
+// vehicles on random routes: every vehicle enters on one of the four approach
+// lanes, queued behind the ones already there, and turns left, goes straight
+// or turns right, spread evenly over the four exits. The map grows when the
+// queues do not fit. The same spec gives the same scenario.
+YAML::Node generate_scenario(const YAML::Node& base, const ScenarioSpec& spec);
+
+#endif
@@ -0,0 +1,93 @@
+#pragma once
+#ifndef __THREAD_POOL_HPP
+#define __THREAD_POOL_HPP
+
+#include <deque>
+#include <mutex>
+#include <atomic>
+#include <memory>
+#include <thread>
+#include <vector>
+#include <future>
+#include <functional>
+#include <condition_variable>
+
+// Work-stealing pool shared by the planners. Tasks submitted from a worker go
+// to the back of its own queue and idle workers steal from the front, outside
+// threads submit to a shared queue. A worker waiting on a future keeps running
+// the tasks the current task spawned still in its queue, then blocks, so nested
+// searches can wait on each other.
+class ThreadPool {
+private:
+    struct Task {
+        uint64_t index;
+        std::function<void(void)> func;
+    };
+    struct WorkQueue {
+        std::mutex mutex;
+        std::deque<Task> tasks;
+    };
+
+    int workers_num;
+    std::vector<std::thread> workers;
+    // one per worker, the last one takes the tasks of outside threads
+    std::vector<std::unique_ptr<WorkQueue>> queues;
+    std::mutex wake_mutex;
+    std::condition_variable wake_cond;
+    std::atomic<bool> stop;
+    std::atomic<int> pending;
+    std::atomic<uint64_t> task_index;
+
+    static thread_local ThreadPool* current_pool;
+    static thread_local int current_worker;
+    static thread_local uint64_t current_task_begin;
+
+    void push(std::function<void(void)> func);
+    bool pop_back(int queue_idx, uint64_t min_index, Task& task);
+    bool pop_front(int queue_idx, Task& task);
+    bool find_task(int worker_idx, Task& task);
+    void run_task(Task& task);
+    void worker_loop(int worker_idx);
+    bool is_worker(void) const {
+        return current_pool == this && current_worker >= 0;
+    }
+
+public:
+    explicit ThreadPool(int threads_num);
+    ~ThreadPool();
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool& operator=(const ThreadPool&) = delete;
+
+    size_t size(void) const {
+        return workers_num;
+    }
+
+    template <typename Func>
+    auto submit(Func&& func) -> std::future<decltype(func())> {
+        using Result = decltype(func());
+        auto task = std::make_shared<std::packaged_task<Result(void)>>(std::forward<Func>(func));
+        std::future<Result> future = task->get_future();
+        push([task]() { (*task)(); });
+
+        return future;
+    }
+
+    template <typename T>
+    T wait(std::future<T>& future) {
+        if (is_worker()) {
+            // only help with descendants of the running task, anything older
+            // may wait on the result this worker is computing. Only this thread
+            // pushes to its queue, so once they are gone or stolen none come
+            // back and it sleeps on the future instead.
+            Task task;
+            while (future.wait_for(std::chrono::seconds(0)) != std::future_status::ready &&
+                   pop_back(current_worker, current_task_begin, task)) {
+                run_task(task);
+            }
+        }
+
+        return future.get();
+    }
+};
+
+#endif
@@ -0,0 +1,98 @@
+#pragma once
+#ifndef __TRACE_HPP
+#define __TRACE_HPP
+
+#include <mutex>
+#include <atomic>
+#include <chrono>
+#include <string>
+#include <vector>
+#include <cstdint>
+
+// Counters of one search. Depth, width and the phase times are only
+// measured while a trace is recorded, the rest is always counted.
+struct SearchStats {
+    uint64_t iterations;
+    uint64_t nodes_created;
+    // created nodes merged into a state of the transposition table
+    uint64_t nodes_merged;
+    uint64_t rollouts;
+    uint64_t reward_evaluations;
+    // box pairs the rewards ran the exact overlap test on, after the broad phase
+    uint64_t collision_checks;
+    int max_depth;
+    int max_width;
+    double tree_policy_time;
+    double default_policy_time;
+    double update_time;
+
+    SearchStats() : iterations(0), nodes_created(0), nodes_merged(0), rollouts(0), reward_evaluations(0), collision_checks(0),
+                    max_depth(0), max_width(0), tree_policy_time(0), default_policy_time(0), update_time(0) {}
+
+    SearchStats& operator+=(const SearchStats& other);
+};
+
+enum class TraceCategory {STEP, PLANNING, PREDICTION, SEARCH};
+
+// One span of the trace. `vehicle` owns the planner that paid for the span,
+// `subject` is the vehicle it plans or predicts, the two differ inside the
+// level-k recursion.
+struct TraceEvent {
+    TraceCategory category;
+    std::string vehicle;
+    std::string subject;
+    int level;
+    int round;
+    int step;
+    int thread;
+    int64_t start_us;
+    int64_t duration_us;
+    // predictions only
+    bool cached;
+    // steps only
+    uint64_t cache_hits;
+    uint64_t cache_misses;
+    // searches and plannings only, a planning carries its ego search
+    SearchStats stats;
+
+    TraceEvent() : category(TraceCategory::STEP), level(0), round(0), step(0), thread(0),
+                   start_us(0), duration_us(0), cached(false), cache_hits(0), cache_misses(0) {}
+};
+
+// Collects the spans of every planner of a run, shared by the vehicles and
+// written once at the end. Spans may be recorded from any thread.
+class TraceRecorder {
+private:
+    std::mutex mutex;
+    std::vector<TraceEvent> events;
+    std::chrono::steady_clock::time_point epoch;
+    std::atomic<int> cur_round;
+    std::atomic<int> cur_step;
+
+    void write_chrome_trace(std::ostream& out) const;
+    void write_csv(std::ostream& out) const;
+public:
+    TraceRecorder() : epoch(std::chrono::steady_clock::now()), cur_round(0), cur_step(0) {}
+    ~TraceRecorder() {}
+
+    void set_step(int round, int step) {
+        cur_round = round;
+        cur_step = step;
+    }
+
+    // microseconds since the recorder was created
+    int64_t now_us(void) const {
+        return std::chrono::duration_cast<std::chrono::microseconds>(
+            std::chrono::steady_clock::now() - epoch).count();
+    }
+
+    TraceEvent begin(TraceCategory category, const std::string& vehicle, const std::string& subject, int level);
+    void end(TraceEvent& event);
+    size_t size(void);
+    // the counters of all spans of `category` added up, `count` gets their number
+    SearchStats total(TraceCategory category, size_t* count = nullptr);
+    // ".csv" writes one row per span, anything else a Chrome trace (chrome://tracing, Perfetto)
+    bool save(const std::string& path);
+};
+
+#endif
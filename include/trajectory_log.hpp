@@ -0,0 +1,144 @@
+#pragma once
+#ifndef __TRAJECTORY_LOG_HPP
+#define __TRAJECTORY_LOG_HPP
+
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <fstream>
+#include <type_traits>
+
+#include "utils.hpp"
+#include "vehicle.hpp"
+
+// Binary log of one round, in host byte order. A header and one entry per
+// agent come first, then one fixed size block per tick, so a reader finds
+// tick k by arithmetic. Tick 0 holds the initial states, tick k > 0 the states
+// after k steps together with the actions, plans and counters of step k.
+//
+//   TrajectoryLogHeader
+//   TrajectoryLogAgent                   x agents_num
+//   tick: TrajectoryLogTick
+//         (TrajectoryLogRecord, State x horizon)  x agents_num
+
+static_assert(sizeof(State) == 4 * sizeof(double) && std::is_trivially_copyable<State>::value,
+              "State is written to the trajectory log as is");
+
+struct TrajectoryLogHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t agents_num;
+    // states per expected trajectory, shorter plans are padded
+    uint32_t horizon;
+    uint32_t round;
+    uint64_t seed;
+    double dt;
+    char reserved[24];
+};
+
+struct TrajectoryLogAgent {
+    char name[32];
+    char color[16];
+    int32_t level;
+    int32_t reserved;
+    State target;
+    State text_pos;
+    char padding[8];
+};
+
+struct TrajectoryLogTick {
+    uint32_t step;
+    uint32_t reserved;
+    double simulation_time;
+    // wall time of the step in seconds
+    double step_cost;
+    uint32_t cache_hits;
+    uint32_t cache_misses;
+};
+
+struct TrajectoryLogRecord {
+    State state;
+    uint64_t iterations;
+    uint8_t action;
+    uint8_t reached;
+    // the vehicle moved in this step, its state belongs to the footprint
+    uint8_t moved;
+    uint8_t reserved;
+    uint32_t traj_len;
+};
+
+static_assert(sizeof(TrajectoryLogHeader) == 64, "trajectory log header layout");
+static_assert(sizeof(TrajectoryLogAgent) == 128, "trajectory log agent layout");
+static_assert(sizeof(TrajectoryLogTick) == 32, "trajectory log tick layout");
+static_assert(sizeof(TrajectoryLogRecord) == 48, "trajectory log record layout");
+
+// Appends the ticks of one round as they happen, nothing of the round is kept
+// in memory. Only the thread running the round writes to it.
+class TrajectoryLogWriter {
+private:
+    std::ofstream out;
+    uint32_t horizon;
+    std::vector<char> buffer;
+public:
+    TrajectoryLogWriter(const std::string& path, VehicleList& vehicles, int horizon_len, double dt,
+                        int round, uint64_t seed);
+    ~TrajectoryLogWriter() {}
+
+    bool is_open(void) const {
+        return out.is_open();
+    }
+    // step 0 logs the initial states, later steps the last_step() of every vehicle after the commit
+    void append(int step, double simulation_time, double step_cost, uint64_t cache_hits, uint64_t cache_misses,
+                VehicleList& vehicles);
+};
+
+// Read only view of a log written by TrajectoryLogWriter, memory mapped so the
+// ticks are only paged in when they are read.
+class TrajectoryLogReader {
+private:
+    const char* data;
+    size_t length;
+    size_t tick_size;
+    size_t ticks_num;
+
+    const char* tick_at(size_t tick) const {
+        return data + sizeof(TrajectoryLogHeader) + header().agents_num * sizeof(TrajectoryLogAgent) +
+               tick * tick_size;
+    }
+    const char* record_at(size_t tick, size_t agent) const {
+        return tick_at(tick) + sizeof(TrajectoryLogTick) +
+               agent * (sizeof(TrajectoryLogRecord) + header().horizon * sizeof(State));
+    }
+public:
+    TrajectoryLogReader() : data(nullptr), length(0), tick_size(0), ticks_num(0) {}
+    ~TrajectoryLogReader();
+    TrajectoryLogReader(const TrajectoryLogReader&) = delete;
+    TrajectoryLogReader& operator=(const TrajectoryLogReader&) = delete;
+
+    bool open(const std::string& path);
+
+    const TrajectoryLogHeader& header(void) const {
+        return *reinterpret_cast<const TrajectoryLogHeader*>(data);
+    }
+    size_t agents(void) const {
+        return header().agents_num;
+    }
+    size_t ticks(void) const {
+        return ticks_num;
+    }
+    const TrajectoryLogAgent& agent(size_t agent) const {
+        return reinterpret_cast<const TrajectoryLogAgent*>(data + sizeof(TrajectoryLogHeader))[agent];
+    }
+    const TrajectoryLogTick& tick(size_t tick) const {
+        return *reinterpret_cast<const TrajectoryLogTick*>(tick_at(tick));
+    }
+    const TrajectoryLogRecord& record(size_t tick, size_t agent) const {
+        return *reinterpret_cast<const TrajectoryLogRecord*>(record_at(tick, agent));
+    }
+    // the expected trajectory planned in the tick, record().traj_len states
+    const State* planned(size_t tick, size_t agent) const {
+        return reinterpret_cast<const State*>(record_at(tick, agent) + sizeof(TrajectoryLogRecord));
+    }
+};
+
+#endif
@@ -2,19 +2,26 @@
 #ifndef __UTILS_HPP
 #define __UTILS_HPP
 
+#include <array>
+#include <cmath>
 #include <chrono>
+#include <cstddef>
+#include <cstdint>
 #include <vector>
+#include <iterator>
 #include <memory>
 #include <random>
 #include <string>
 #include <algorithm>
 #include <stdexcept>
 #include <functional>
+#include <type_traits>
+#include <unordered_map>
 
 #include <Eigen/Core>
 
 
-enum class Action {MAINTAIN, TURNLEFT, TURNRIGHT, ACCELERATE, DECELERATE, BRAKE};
+enum class Action : uint8_t {MAINTAIN, TURNLEFT, TURNRIGHT, ACCELERATE, DECELERATE, BRAKE};
 const std::vector<Action> ACTION_LIST = {
     Action::MAINTAIN,   // (0, 0)
     Action::TURNLEFT,   // (0, pi/4)
@@ -23,10 +30,18 @@ const std::vector<Action> ACTION_LIST = {
     Action::DECELERATE, // (-2.5, 0)
     Action::BRAKE       // (-5.0, 0)
 };
-
+constexpr size_t ACTION_NUM = 6;
+// (acceleration, steering) of every action, indexed by Action
+constexpr std::array<std::array<double, 2>, ACTION_NUM> ACTION_VALUES = {{
+    {0, 0}, {0, M_PI_4}, {0, -M_PI_4}, {2.5, 0}, {-2.5, 0}, {-5.0, 0}
+}};
+
+// Every thread draws from its own engine, seeded from std::random_device
+// unless the thread calls Random::seed() before its first draw. Work that
+// must replay on any thread draws from a Stream derived from its parent's seed.
 class Random {
 private:
-    static std::default_random_engine engine;
+    static thread_local std::default_random_engine engine;
 
     Random() = delete;
     Random(const Random&) = delete;
@@ -34,6 +49,32 @@ private:
     Random(Random&&) = delete;
     Random& operator=(Random&&) = delete;
 public:
+    // The draws of this thread follow `_seed` while the stream lives, then the
+    // thread resumes its previous sequence. Streams nest, so a task run by a
+    // waiting worker leaves the draws of the waiting task untouched.
+    class Stream {
+    private:
+        std::default_random_engine saved;
+    public:
+        explicit Stream(uint64_t _seed) : saved(Random::engine) {
+            Random::seed(_seed);
+        }
+        ~Stream() {
+            Random::engine = saved;
+        }
+        Stream(const Stream&) = delete;
+        Stream& operator=(const Stream&) = delete;
+    };
+
+    static void seed(uint64_t _seed);
+    // seed of the stream `key` below `parent`, a pure function of both
+    static uint64_t derive(uint64_t parent, uint64_t key);
+    template <typename... Keys>
+    static uint64_t derive(uint64_t parent, uint64_t key, Keys... keys) {
+        return derive(derive(parent, key), static_cast<uint64_t>(keys)...);
+    }
+    // a fresh seed from the draws of this thread
+    static uint64_t draw_seed(void);
     static int uniform(int _min, int _max);
     static double uniform(double _min, double _max);
     template <typename T>
@@ -51,16 +92,16 @@ class TicToc {
 public:
     TicToc(void) { tic(); }
 
-    void tic(void) { start = std::chrono::system_clock::now(); }
+    void tic(void) { start = std::chrono::steady_clock::now(); }
 
     double toc(void) {
-        end = std::chrono::system_clock::now();
+        end = std::chrono::steady_clock::now();
         std::chrono::duration<double> elapsed_seconds = end - start;
         return elapsed_seconds.count();
     }
 
 private:
-    std::chrono::time_point<std::chrono::system_clock> start, end;
+    std::chrono::time_point<std::chrono::steady_clock> start, end;
 };
 
 class State {
@@ -75,48 +116,126 @@ public:
     State() : x(0), y(0), yaw(0), v(0) {}
     State(double _x, double _y, double _yaw, double _v) :
         x(_x), y(_y), yaw(_yaw), v(_v) {}
-    ~State() {}
 
     std::vector<double> to_vector(void) {
         return std::vector<double>{x, y, yaw, v};
     }
 };
 
+// Oriented box given by its center, half extents along its own axes and heading.
+struct OrientedBox {
+    double x;
+    double y;
+    double half_length;
+    double half_width;
+    double cos_yaw;
+    double sin_yaw;
+
+    // half of the box's extent along the world x axis
+    double x_extent(void) const {
+        return half_length * std::abs(cos_yaw) + half_width * std::abs(sin_yaw);
+    }
+};
+
+// Contiguous run of boxes, handed to the overlap kernels as is.
+struct BoxSpan {
+    const OrientedBox* data;
+    size_t size;
+};
+
+// Column views of `size` simulations stepped together, cos_yaw/sin_yaw follow yaw.
+struct StateBatch {
+    double* x;
+    double* y;
+    double* yaw;
+    double* v;
+    double* cos_yaw;
+    double* sin_yaw;
+    size_t size;
+};
+
+// Trajectory stored as columns x, y, yaw, v of `capacity` each in one buffer.
+// States are read by value, the plotting rows are only built by to_vector().
 class StateList {
 private:
-    std::vector<State> states;
-    std::vector<std::vector<double>> state_list;
-    std::vector<std::vector<double>> state_list_trans;
+    static constexpr size_t COLUMNS = 4;
+    std::vector<double> data;
+    size_t length;
+    size_t capacity;
+
+    double* column(size_t col) {
+        return data.data() + col * capacity;
+    }
+    const double* column(size_t col) const {
+        return data.data() + col * capacity;
+    }
     void append(const State& state) {
-        states.push_back(state);
-        state_list_trans[0].push_back(state.x);
-        state_list_trans[1].push_back(state.y);
-        state_list_trans[2].push_back(state.yaw);
-        state_list_trans[3].push_back(state.v);
-        std::vector<double> state_vec_tmp = {state.x, state.y, state.yaw, state.v};
-        state_list.emplace_back(state_vec_tmp);
+        if (length == capacity) {
+            reserve(std::max<size_t>(2 * capacity, 4));
+        }
+        set(length++, state);
+    }
+    void set(size_t index, const State& state) {
+        column(0)[index] = state.x;
+        column(1)[index] = state.y;
+        column(2)[index] = state.yaw;
+        column(3)[index] = state.v;
     }
 public:
-    StateList() {
-        states.clear();
-        state_list.clear();
-        state_list_trans.clear();
-        state_list_trans.resize(4);
-    }
-    StateList(const std::vector<State>& st) {
-        states.clear();
-        state_list.clear();
-        state_list_trans.clear();
-        state_list_trans.resize(4);
+    class const_iterator {
+    private:
+        const StateList* list;
+        size_t index;
+    public:
+        using iterator_category = std::forward_iterator_tag;
+        using value_type = State;
+        using difference_type = std::ptrdiff_t;
+        using pointer = void;
+        using reference = State;
+
+        const_iterator(const StateList* l, size_t idx) : list(l), index(idx) {}
+        State operator*() const {
+            return list->at(index);
+        }
+        const_iterator& operator++() {
+            ++index;
+            return *this;
+        }
+        bool operator==(const const_iterator& other) const {
+            return index == other.index;
+        }
+        bool operator!=(const const_iterator& other) const {
+            return index != other.index;
+        }
+    };
 
+    StateList() : length(0), capacity(0) {}
+    StateList(const std::vector<State>& st) : length(0), capacity(0) {
+        reserve(st.size());
         for (const State& s : st) {
             this->append(s);
         }
     }
     ~StateList() {}
 
-    size_t size(void) {
-        return states.size();
+    size_t size(void) const {
+        return length;
+    }
+
+    bool empty(void) const {
+        return length == 0;
+    }
+
+    void reserve(size_t new_capacity) {
+        if (new_capacity <= capacity) {
+            return ;
+        }
+        std::vector<double> new_data(COLUMNS * new_capacity);
+        for (size_t col = 0; col < COLUMNS; ++col) {
+            std::copy(column(col), column(col) + length, new_data.data() + col * new_capacity);
+        }
+        data.swap(new_data);
+        capacity = new_capacity;
     }
 
     void push_back(const State& state) {
@@ -124,113 +243,324 @@ public:
     }
 
     void reverse(void) {
-        std::reverse(states.begin(), states.end());
-        std::reverse(state_list.begin(), state_list.end());
-        for (size_t idx = 0; idx < state_list_trans.size(); ++idx) {
-            std::reverse(state_list_trans[idx].begin(), state_list_trans[idx].end());
+        for (size_t col = 0; col < COLUMNS; ++col) {
+            std::reverse(column(col), column(col) + length);
         }
     }
 
     void expand(int excepted_len) {
-        if (states.size() < 1) {
+        if (length < 1) {
             return ;
         }
-       State expand_state = states[-1];
+       State expand_state = at(length - 1);
        expand(excepted_len, expand_state);
     }
 
     void expand(int excepted_len, const State& expand_state) {
-        size_t cur_size = states.size();
-        if (cur_size >= excepted_len) {
+        size_t cur_size = length;
+        if (excepted_len <= 0 || cur_size >= static_cast<size_t>(excepted_len)) {
             return ;
         }
 
+        reserve(excepted_len);
         for (size_t it = 0; it < excepted_len - cur_size; ++it) {
             this->append(expand_state);
         }
     }
 
-    std::vector<std::vector<double>> to_vector(bool trans = true) {
+    std::vector<std::vector<double>> to_vector(bool trans = true) const {
+        std::vector<std::vector<double>> rows;
         if (trans) {
-            return state_list_trans;
+            for (size_t col = 0; col < COLUMNS; ++col) {
+                rows.emplace_back(column(col), column(col) + length);
+            }
         } else {
-            return state_list;
+            for (size_t idx = 0; idx < length; ++idx) {
+                rows.push_back({column(0)[idx], column(1)[idx], column(2)[idx], column(3)[idx]});
+            }
         }
+        return rows;
     }
 
-    State& operator[](int index) {
-        if (index < 0 || index >= states.size()) {
-            throw std::out_of_range("Index out of range");
-        }
-        return states[index];
+    const double* x(void) const {
+        return column(0);
     }
-
-    const State& operator[](int index) const {
-        if (index < 0 || index >= states.size()) {
-            throw std::out_of_range("Index out of range");
-        }
-        return states[index];
+    const double* y(void) const {
+        return column(1);
+    }
+    const double* yaw(void) const {
+        return column(2);
+    }
+    const double* v(void) const {
+        return column(3);
     }
 
-    auto begin() {
-        return states.begin();
+    State at(size_t index) const {
+        return State(column(0)[index], column(1)[index], column(2)[index], column(3)[index]);
     }
 
-    auto end() {
-        return states.end();
+    State operator[](int index) const {
+        if (index < 0 || static_cast<size_t>(index) >= length) {
+            throw std::out_of_range("Index out of range");
+        }
+        return at(index);
     }
 
-    auto begin() const {
-        return states.begin();
+    const_iterator begin() const {
+        return const_iterator(this, 0);
     }
 
-    auto end() const {
-        return states.end();
+    const_iterator end() const {
+        return const_iterator(this, length);
     }
 };
 
-class Node : public std::enable_shared_from_this<Node> {
+using NodeId = int32_t;
+constexpr NodeId INVALID_NODE = -1;
+
+class PredictionTable;
+
+// The counters and links fill the first 48 bytes, the states the expansion
+// and the rewards read and the rotation of the state the rest. A child
+// takes cos/sin of its yaw from the parent unless its action turns, so
+// boxes are built without any trigonometry. The path of a node is its chain
+// of parents, nodes keep no per-node heap.
+class alignas(64) Node {
 private:
     /* data */
 public:
     static int MAX_LEVEL;
-    // static double (*calc_value_callback)(std::shared_ptr<Node>, double);
-    static std::function<double(std::shared_ptr<Node>, double)> calc_value_callback;
 
-    State state;
-    double value;
     double reward;
+    double value;
+    const PredictionTable* predictions;
     int visits;
-    Action action;
-    std::shared_ptr<Node> parent;
+    NodeId parent;
+    // the ChildBlock of this node in its pool, -1 until the first child
+    int32_t children;
+    // the Transposition this node was merged into
+    int32_t transposition;
     int cur_level;
+    uint8_t children_num;
+    Action action;
+    // position of this node in the ChildBlock of its parent
+    uint8_t slot;
+    State state;
     State goal_pose;
-    std::vector<std::shared_ptr<Node>> children;
-    std::vector<Action> actions;
-    StateList other_agent_state;
-    
+    // cos/sin of state.yaw
+    double cos_yaw;
+    double sin_yaw;
+
     Node() = delete;
-    Node(State _state, int _level, std::shared_ptr<Node> p, Action act, StateList others, State goal);
-    ~Node() {}
+    Node(State _state, double _cos_yaw, double _sin_yaw, int _level, NodeId p, Action act,
+         const PredictionTable* others, State goal);
+    Node(State _state, int _level, NodeId p, Action act, const PredictionTable* others, State goal) :
+        Node(_state, cos(_state.yaw), sin(_state.yaw), _level, p, act, others, goal) {}
 
-    static void initialize(int max_level, double (*callback)(std::shared_ptr<Node>, double)) {
+    static void initialize(int max_level) {
         Node::MAX_LEVEL = max_level;
-        Node::calc_value_callback = callback;
     }
 
-    bool is_terminal(void);
-    bool is_fully_expanded(void);
-    std::shared_ptr<Node> add_child(Action next_action, double delta_t, StateList others);
-    std::shared_ptr<Node> next_node(double delta_t, StateList others);
+    bool is_terminal(void) const;
+    bool is_fully_expanded(void) const;
+};
+
+static_assert(std::is_trivially_destructible<Node>::value, "Node must stay trivially destructible");
+static_assert(sizeof(Node) <= 128, "Node must fit in two cache lines");
+static_assert(offsetof(Node, state) == 48, "Node counters and links must stay in the first 48 bytes");
+
+constexpr int32_t NO_TRANSPOSITION = -1;
+
+// The children of one node side by side, slot k holds the k-th child added.
+// Selection scores every child from here without touching the child nodes,
+// the pool keeps visits and reward equal to the ones of the child node. A
+// merged child is scored from its Transposition instead.
+struct alignas(64) ChildBlock {
+    double reward[ACTION_NUM];
+    int visits[ACTION_NUM];
+    NodeId child[ACTION_NUM];
+    // the Transposition of the child, NO_TRANSPOSITION until it is merged
+    int32_t transposition[ACTION_NUM];
+    Action action[ACTION_NUM];
+};
+
+static_assert(sizeof(ChildBlock) == 128, "ChildBlock must fit in two cache lines");
+
+// Cells of a state at one depth, nodes of the same cells are the same state.
+struct TranspositionKey {
+    int64_t x;
+    int64_t y;
+    int64_t yaw;
+    int64_t v;
+    int level;
+
+    bool operator==(const TranspositionKey& other) const {
+        return x == other.x && y == other.y && yaw == other.yaw && v == other.v && level == other.level;
+    }
+};
+
+struct TranspositionKeyHash {
+    size_t operator()(const TranspositionKey& key) const;
+};
+
+// Statistics shared by the nodes merged into one state. The part of a return
+// before the state depends on the path to it, so only the part after it is
+// shared: `future` sums the returns less the value of the node they passed.
+// A merged node reaching the state with `value` shows visits and
+// visits * value + future.
+struct Transposition {
+    // reward of the state, evaluated once for all its nodes
+    double reward;
+    double future;
+    int visits;
+};
+
+// Arena of search tree nodes linked by index. Nodes own no heap memory, so
+// reset() only rewinds the size and keeps the capacity for the next search.
+// Visits and rewards are written through add_stats()/set_stats() so the
+// ChildBlock of the parent follows them.
+//
+// With transpositions enabled, children reaching the same cells of (x, y,
+// yaw, v) at one depth are merged: each keeps its own subtree and statistics,
+// while the ChildBlock slot of every one of them points at the Transposition,
+// which a backup updates once, so selection sees every path into the state.
+// Nodes copied in from another pool stay unmerged.
+class NodePool {
+private:
+    std::vector<Node> nodes;
+    std::vector<ChildBlock> blocks;
+    // cell sizes of x, y and v and of yaw, 0 merges nothing
+    double transposition_cell;
+    double transposition_yaw_cell;
+    std::vector<Transposition> transpositions;
+    std::unordered_map<TranspositionKey, int32_t, TranspositionKeyHash> transposition_index;
+    uint64_t merged;
+
+    NodeId append(State _state, double cos_yaw, double sin_yaw, int _level, NodeId p, Action act,
+                  const PredictionTable* others, State goal);
+    void link_child(NodeId parent_id, NodeId child_id);
+    TranspositionKey transposition_key(const Node& node) const;
+    void share_stats(const Node& node, int visits, double reward);
+public:
+    NodePool() : transposition_cell(0), transposition_yaw_cell(0), merged(0) {}
+    ~NodePool() {}
+
+    void enable_transpositions(double cell, double yaw_cell) {
+        transposition_cell = cell > 0 && yaw_cell > 0 ? cell : 0.0;
+        transposition_yaw_cell = transposition_cell > 0 ? yaw_cell : 0.0;
+    }
+
+    void reserve(size_t capacity) {
+        nodes.reserve(capacity);
+        // most nodes of a search stay leaves
+        blocks.reserve(capacity / 2);
+    }
+
+    void reset(void) {
+        nodes.clear();
+        blocks.clear();
+        transpositions.clear();
+        transposition_index.clear();
+        merged = 0;
+    }
+
+    size_t size(void) const {
+        return nodes.size();
+    }
+
+    // memory held by the pool, used or only reserved
+    size_t reserved_bytes(void) const {
+        return nodes.capacity() * sizeof(Node) + blocks.capacity() * sizeof(ChildBlock) +
+               transpositions.capacity() * sizeof(Transposition);
+    }
+
+    // children merged into an earlier state since the last reset()
+    uint64_t merged_count(void) const {
+        return merged;
+    }
+
+    NodeId create(State _state, int _level, NodeId p, Action act, const PredictionTable* others, State goal);
+    // the search propagates and evaluates the child, it owns the reward
+    NodeId add_child(NodeId parent_id, Action next_action, const State& child_state,
+                     double child_cos_yaw, double child_sin_yaw);
+    NodeId copy_node(const Node& src, NodeId parent_id);
+    // the state `id` would be merged into, nullptr when it is new or transpositions are off
+    const Transposition* find_transposition(NodeId id) const;
+    // merges the evaluated child `id` into its state, `reward` is the one of the state
+    void transpose(NodeId id, double reward);
+
+    // only valid while the node has children
+    const ChildBlock& children_of(NodeId id) const {
+        return blocks[nodes[id].children];
+    }
+
+    const Transposition& transposition_of(int32_t idx) const {
+        return transpositions[idx];
+    }
+
+    void add_stats(NodeId id, int visits, double reward) {
+        Node& node = nodes[id];
+        node.visits += visits;
+        node.reward += reward;
+        if (node.transposition != NO_TRANSPOSITION) {
+            share_stats(node, visits, reward);
+        } else if (node.parent != INVALID_NODE) {
+            ChildBlock& block = blocks[nodes[node.parent].children];
+            block.visits[node.slot] = node.visits;
+            block.reward[node.slot] = node.reward;
+        }
+    }
+
+    void set_stats(NodeId id, int visits, double reward) {
+        Node& node = nodes[id];
+        int visits_change = visits - node.visits;
+        double reward_change = reward - node.reward;
+        node.visits = visits;
+        node.reward = reward;
+        if (node.transposition != NO_TRANSPOSITION) {
+            share_stats(node, visits_change, reward_change);
+        } else if (node.parent != INVALID_NODE) {
+            ChildBlock& block = blocks[nodes[node.parent].children];
+            block.visits[node.slot] = node.visits;
+            block.reward[node.slot] = node.reward;
+        }
+    }
+
+    Node& operator[](NodeId id) {
+        return nodes[id];
+    }
+
+    const Node& operator[](NodeId id) const {
+        return nodes[id];
+    }
 };
 
 namespace utils {
 
     std::string get_action_name(Action action);
-    Eigen::Vector2d get_action_value(Action act);
-    bool has_overlap(Eigen::MatrixXd box2d_0, Eigen::MatrixXd box2d_1);
+    inline Eigen::Vector2d get_action_value(Action act) {
+        const std::array<double, 2>& value = ACTION_VALUES[static_cast<size_t>(act)];
+        return Eigen::Vector2d(value[0], value[1]);
+    }
+    bool has_overlap(const Eigen::Ref<const Eigen::MatrixXd>& box2d_0,
+                     const Eigen::Ref<const Eigen::MatrixXd>& box2d_1);
+    bool has_overlap(const OrientedBox& box_0, const OrientedBox& box_1);
+    bool has_any_overlap(const OrientedBox& box, const OrientedBox* others, size_t others_num);
+    // box pairs has_any_overlap() ran the exact test on in this thread, it stops at the first hit
+    extern thread_local uint64_t overlap_tests;
+    // into [0, 2pi] without loops, one step from a yaw in (-2pi, 2pi] is at most one turn off
+    inline double wrap_yaw(double yaw) {
+        yaw -= yaw > 2 * M_PI ? 2 * M_PI : 0.0;
+        yaw += yaw < 0 ? 2 * M_PI : 0.0;
+        return yaw;
+    }
     State kinematic_propagate(const State& state, Eigen::Vector2d act, double dt);
+    // steps simulation k under actions[k] in place, cos_yaw/sin_yaw must hold the ones of yaw
+    void propagate_batch(StateBatch& batch, const Action* actions, double dt);
     std::string absolute_path(std::string path);
+    inline void hash_combine(size_t& seed, size_t value) {
+        seed ^= value + 0x9e3779b97f4a7c15ULL + (seed << 6) + (seed >> 2);
+    }
 
 }
 
@@ -10,12 +10,24 @@
 #include "utils.hpp"
 #include "vehicle_base.hpp"
 #include "planner.hpp"
+#include "world.hpp"
 #include "tracked_object.hpp"
 
+// What planning one step decided, kept aside until every vehicle has planned.
+struct PlannedStep {
+    State state;
+    Action action;
+    StateList excepted_traj;
+    bool have_got_target;
+    bool moved;
+};
+
 class Vehicle : public VehicleBase {
 private:
     double dt;
     KLevelPlanner planner;
+    // back buffer of the step, excute() writes it and commit() applies it
+    PlannedStep next_step;
     double init_x_min;
     double init_x_max;
     double init_y_min;
@@ -27,18 +39,40 @@ public:
     std::string color;
     Action cur_action;
     StateList excepted_traj;
-    std::vector<State> footprint;
     Eigen::Matrix<double, 2, 5, Eigen::RowMajor> vehicle_box2d;
     Eigen::Matrix<double, 2, 5, Eigen::RowMajor> safezone;
     State vis_text_pos;
     std::vector<TrackedObject> tracked_objects;
 
-    Vehicle(std::string _name, const YAML::Node& cfg);
+    // vehicles of one simulation may share a planning context, without one the vehicle sets up its own
+    Vehicle(std::string _name, const YAML::Node& cfg, std::shared_ptr<PlanningContext> context = nullptr);
     ~Vehicle() {}
 
     void reset(void);
-    void excute(std::vector<VehicleBase> others);
-    void draw_vehicle(bool fill_mode = false);
+    // Plans the next step of agent `id` of the world. Only reads the world and
+    // writes the back buffer, so the vehicles of a step may plan side by side;
+    // they pass the same world and seed, see KLevelPlanner::planning().
+    void excute(const WorldSnapshot& world, int id, uint64_t seed);
+    // moves to the planned step, once every vehicle of the step has planned,
+    // and returns it; its plan is handed over to excepted_traj
+    const PlannedStep& commit(void);
+    // the step the last commit() moved to, a step that did not move after reset()
+    const PlannedStep& last_step(void) const {
+        return next_step;
+    }
+    void set_prediction_cache(std::shared_ptr<PredictionCache> cache) {
+        planner.set_prediction_cache(cache);
+    }
+    void set_thread_pool(std::shared_ptr<ThreadPool> pool) {
+        planner.set_thread_pool(pool);
+    }
+    void set_trace(std::shared_ptr<TraceRecorder> recorder) {
+        planner.set_trace(recorder);
+    }
+    uint64_t planned_iterations(void) const {
+        return planner.get_iterations();
+    }
+    static void draw_vehicle(const State& state, const std::string& color, bool fill_mode = false);
     bool operator==(const Vehicle& other) const {
         return name == other.name;
     }
@@ -65,9 +99,11 @@ public:
     void push_back(std::shared_ptr<Vehicle> vehicle);
     void pop_back(void);
     void reset(void);
+    // the barrier of a step, all vehicles move to their planned step together
+    void commit(void);
     void set_track_objects(void);
-    std::vector<VehicleBase> exclude(int ego_idx);
-    std::vector<VehicleBase> exclude(std::shared_ptr<Vehicle> ego);
+    // the vehicles as they are now, agent ids follow the list order
+    WorldSnapshot snapshot(void) const;
     std::shared_ptr<Vehicle> operator[](size_t index) {
         return vehicle_list[index];
     }
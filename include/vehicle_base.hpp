@@ -46,34 +46,57 @@ public:
         VehicleBase::env = _env;
     }
 
+    // Corners of a box with half extents `half_length`, `half_width` around the state,
+    // closed back to the first one. Same arithmetic as rotating the corners of the
+    // box frame, without a template matrix.
+    static Eigen::Matrix<double, 2, 5> get_box_corners(const State& center, double cos_yaw, double sin_yaw,
+                                                         double half_length, double half_width) {
+        double length_x = cos_yaw * half_length;
+        double length_y = sin_yaw * half_length;
+        double width_x = sin_yaw * half_width;
+        double width_y = cos_yaw * half_width;
+        Eigen::Matrix<double, 2, 5, Eigen::RowMajor> corners;
+        corners << -length_x - width_x, length_x - width_x, length_x + width_x, -length_x + width_x, -length_x - width_x,
+                   -length_y + width_y, length_y + width_y, length_y - width_y, -length_y - width_y, -length_y + width_y;
+        corners += Eigen::Vector2d(center.x, center.y).replicate(1, 5);
+
+        return corners;
+    }
+
     static Eigen::Matrix<double, 2, 5> get_box2d(const State& tar_offset) {
-        Eigen::Matrix<double, 2, 5, Eigen::RowMajor> vehicle;
-        vehicle << -VehicleBase::length/2, VehicleBase::length/2,
-                    VehicleBase::length/2, -VehicleBase::length/2, -VehicleBase::length/2,
-                    VehicleBase::width/2, VehicleBase::width/2,
-                    -VehicleBase::width/2, -VehicleBase::width/2, VehicleBase::width/2;
-        Eigen::Matrix2d rot;
-        rot << cos(tar_offset.yaw), -sin(tar_offset.yaw), sin(tar_offset.yaw), cos(tar_offset.yaw);
-        
-        vehicle = rot * vehicle;
-        vehicle += Eigen::Vector2d(tar_offset.x, tar_offset.y).replicate(1, 5);
-
-        return vehicle;
+        return get_box2d(tar_offset, cos(tar_offset.yaw), sin(tar_offset.yaw));
+    }
+
+    static Eigen::Matrix<double, 2, 5> get_box2d(const State& tar_offset, double cos_yaw, double sin_yaw) {
+        return get_box_corners(tar_offset, cos_yaw, sin_yaw, VehicleBase::length / 2, VehicleBase::width / 2);
     }
 
     static Eigen::Matrix<double, 2, 5> get_safezone(const State& tar_offset) {
-        Eigen::Matrix<double, 2, 5, Eigen::RowMajor> safezone;
-        safezone << -VehicleBase::safe_length/2, VehicleBase::safe_length/2,
-                    VehicleBase::safe_length/2, -VehicleBase::safe_length/2, -VehicleBase::safe_length/2,
-                    VehicleBase::safe_width/2, VehicleBase::safe_width/2,
-                    -VehicleBase::safe_width/2, -VehicleBase::safe_width/2, VehicleBase::safe_width/2;
-        Eigen::Matrix2d rot;
-        rot << cos(tar_offset.yaw), -sin(tar_offset.yaw), sin(tar_offset.yaw), cos(tar_offset.yaw);
-
-        safezone = rot * safezone;
-        safezone += Eigen::Vector2d(tar_offset.x, tar_offset.y).replicate(1, 5);
-
-        return safezone;
+        return get_safezone(tar_offset, cos(tar_offset.yaw), sin(tar_offset.yaw));
+    }
+
+    // the safezone turns with the vehicle, it shares the rotation of its box
+    static Eigen::Matrix<double, 2, 5> get_safezone(const State& tar_offset, double cos_yaw, double sin_yaw) {
+        return get_box_corners(tar_offset, cos_yaw, sin_yaw,
+                               VehicleBase::safe_length / 2, VehicleBase::safe_width / 2);
+    }
+
+    static OrientedBox get_obb(const State& tar_offset) {
+        return get_obb(tar_offset, cos(tar_offset.yaw), sin(tar_offset.yaw));
+    }
+
+    static OrientedBox get_obb(const State& tar_offset, double cos_yaw, double sin_yaw) {
+        return OrientedBox{tar_offset.x, tar_offset.y, VehicleBase::length / 2, VehicleBase::width / 2,
+                           cos_yaw, sin_yaw};
+    }
+
+    static OrientedBox get_safezone_obb(const State& tar_offset) {
+        return get_safezone_obb(tar_offset, cos(tar_offset.yaw), sin(tar_offset.yaw));
+    }
+
+    static OrientedBox get_safezone_obb(const State& tar_offset, double cos_yaw, double sin_yaw) {
+        return OrientedBox{tar_offset.x, tar_offset.y, VehicleBase::safe_length / 2, VehicleBase::safe_width / 2,
+                           cos_yaw, sin_yaw};
     }
 };
 
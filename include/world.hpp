@@ -0,0 +1,58 @@
+#pragma once
+#ifndef __WORLD_HPP
+#define __WORLD_HPP
+
+#include <string>
+#include <vector>
+#include <cstdint>
+
+#include "utils.hpp"
+#include "vehicle_base.hpp"
+
+// The agents as they were at the start of one step, one column per field,
+// indexed by agent id. It is built once per step and only read afterwards,
+// a planner sees "every agent except its ego" by skipping one id, the level-k
+// recursion swaps the ego id instead of copying vehicles.
+class WorldSnapshot {
+private:
+    std::vector<std::string> names;
+    std::vector<size_t> name_hashes;
+    std::vector<State> states;
+    std::vector<State> targets;
+    std::vector<int> levels;
+    std::vector<uint8_t> reached;
+    // hash of name, state, target and reached of every agent, and the same hashes sorted
+    std::vector<size_t> agent_hashes;
+    std::vector<size_t> sorted_hashes;
+public:
+    WorldSnapshot() {}
+    explicit WorldSnapshot(const std::vector<const VehicleBase*>& vehicles);
+    // the ego gets id 0, the others follow in order
+    WorldSnapshot(const VehicleBase& ego, const std::vector<VehicleBase>& others);
+
+    size_t size(void) const {
+        return states.size();
+    }
+    const std::string& name(int id) const {
+        return names[id];
+    }
+    size_t name_hash(int id) const {
+        return name_hashes[id];
+    }
+    const State& state(int id) const {
+        return states[id];
+    }
+    const State& target(int id) const {
+        return targets[id];
+    }
+    int level(int id) const {
+        return levels[id];
+    }
+    bool is_get_target(int id) const {
+        return reached[id] != 0;
+    }
+    // the agent with the other agents as a set, equal worlds seen from the same agent hash equal
+    size_t hash_from(int ego_id) const;
+};
+
+#endif
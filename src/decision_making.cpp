@@ -1,24 +1,31 @@
 #include <cmath>
+#include <limits>
 #include <string>
 #include <memory>
+#include <random>
+#include <algorithm>
 #include <thread>
 #include <getopt.h>
+#include <fstream>
+#include <sstream>
 #include <filesystem>
 #include <unordered_map>
 
 #include <fmt/core.h>
 #include <yaml-cpp/yaml.h>
 #include <spdlog/spdlog.h>
-#include <matplotlib-cpp/matplotlibcpp.h>
 
 #include "env.hpp"
 #include "utils.hpp"
 #include "vehicle.hpp"
 #include "vehicle_base.hpp"
 #include "planner.hpp"
+#include "thread_pool.hpp"
+#include "renderer.hpp"
+#include "trajectory_log.hpp"
+#include "scenario.hpp"
 
 using std::string;
-namespace plt = matplotlibcpp;
 
 static struct option long_options[] = {
     {"rounds", required_argument, 0, 'r'},
@@ -27,45 +34,139 @@ static struct option long_options[] = {
     {"config", required_argument, 0, 'c'},
     {"no_animation", no_argument, 0, 'n'},
     {"save_fig", no_argument, 0, 'f'},
+    {"threads", required_argument, 0, 't'},
+    {"batch", no_argument, 0, 'b'},
+    {"trace", required_argument, 0, 'p'},
+    {"seed", required_argument, 0, 's'},
+    {"record", required_argument, 0, 'w'},
+    {"replay", required_argument, 0, 'y'},
+    {"vehicles", required_argument, 0, 'g'},
+    {"levels", required_argument, 0, 'k'},
+    {0, 0, 0, 0},
 };
 
 std::unordered_map<std::string, spdlog::level::level_enum> LOG_LEVEL_DICT =
     {{"trace", spdlog::level::trace}, {"debug", spdlog::level::debug}, {"info", spdlog::level::info},
      {"warn", spdlog::level::warn}, {"err", spdlog::level::err}, {"critical", spdlog::level::critical}};
 
-void run(int rounds_num, std::filesystem::path config_path,
-    std::filesystem::path save_path, bool show_animation, bool save_fig) {
-    YAML::Node config;
+static void step_vehicles(VehicleList& vehicles, ThreadPool& thread_pool, uint64_t step_seed) {
+    // every vehicle plans against the frozen states at the start of the step and
+    // keeps its result aside, they all move once the last one has planned
+    WorldSnapshot world = vehicles.snapshot();
+    std::vector<std::future<void>> jobs;
+    for (size_t idx = 0; idx < vehicles.size(); ++idx) {
+        Vehicle* vehicle = vehicles[idx].get();
+        jobs.emplace_back(thread_pool.submit([vehicle, &world, idx, step_seed]() {
+            vehicle->excute(world, static_cast<int>(idx), step_seed);
+        }));
+    }
+    for (auto& job : jobs) {
+        thread_pool.wait(job);
+    }
+    vehicles.commit();
+}
+
+static bool load_config(const std::filesystem::path& config_path, YAML::Node& config) {
     spdlog::info(fmt::format("config path: {}", config_path.string()));
     try {
         config = YAML::LoadFile(config_path.string());
         // spdlog::info(fmt::format("config parameters:\n{}", YAML::Dump(config)));
     } catch (const YAML::Exception& e) {
         spdlog::error(fmt::format("Error parsing YAML file: {}", e.what()));
-        return ;
+        return false;
     }
 
+    std::shared_ptr<EnvCrossroads> env = std::make_shared<EnvCrossroads>(config);
+    VehicleBase::initialize(env, 5, 2, 8, 2.4);
+    MonteCarloTreeSearch::initialize(config);
+    Node::initialize(config["max_step"].as<int>());
+
+    return true;
+}
+
+// Writes a scenario of `spec` around the config at `base_path` into `output_path`, empty on failure.
+static std::filesystem::path write_scenario(const std::filesystem::path& base_path,
+    const std::filesystem::path& output_path, const ScenarioSpec& spec) {
+    YAML::Node scenario;
+    try {
+        scenario = generate_scenario(YAML::LoadFile(base_path.string()), spec);
+    } catch (const YAML::Exception& e) {
+        spdlog::error(fmt::format("Error parsing YAML file: {}", e.what()));
+        return std::filesystem::path();
+    }
+    if (!std::filesystem::exists(output_path)) {
+        std::filesystem::create_directories(output_path);
+    }
+    std::filesystem::path scenario_path =
+        output_path / fmt::format("scenario_{}_{}.yaml", spec.vehicles_num, spec.seed);
+    std::ofstream out(scenario_path);
+    out << YAML::Dump(scenario) << std::endl;
+    spdlog::info(fmt::format("{} vehicles generated into {}", spec.vehicles_num, scenario_path.string()));
+
+    return scenario_path;
+}
+
+// one log file per round in the record directory, no log when it is empty
+static std::unique_ptr<TrajectoryLogWriter> open_trajectory_log(const std::filesystem::path& record_path,
+    const YAML::Node& config, VehicleList& vehicles, int round, uint64_t round_seed) {
+    if (record_path.empty()) {
+        return nullptr;
+    }
+    std::filesystem::path log_path = record_path / fmt::format("round_{}.traj", round);
+    std::unique_ptr<TrajectoryLogWriter> writer = std::make_unique<TrajectoryLogWriter>(
+        log_path.string(), vehicles, config["max_step"].as<int>() + 1, config["delta_t"].as<double>(),
+        round, round_seed);
+    if (!writer->is_open()) {
+        return nullptr;
+    }
+    writer->append(0, 0.0, 0.0, 0, 0, vehicles);
+
+    return writer;
+}
+
+void run(int rounds_num, std::filesystem::path config_path, std::filesystem::path save_path,
+    bool show_animation, bool save_fig, int threads_num, std::filesystem::path trace_path, uint64_t seed,
+    std::filesystem::path record_path) {
     // initialize
+    YAML::Node config;
+    if (!load_config(config_path, config)) {
+        return ;
+    }
     double delta_t = config["delta_t"].as<double>();
     double max_simulation_time = config["max_simulation_time"].as<double>();
-    double map_size = config["map_size"].as<double>();
-    double lane_width = config["lane_width"].as<double>();
-
-    std::shared_ptr<EnvCrossroads> env = std::make_shared<EnvCrossroads>(map_size, lane_width);
-    VehicleBase::initialize(env, 5, 2, 8, 2.4);
-    MonteCarloTreeSearch::initialize(config);
-    Node::initialize(config["max_step"].as<int>(), MonteCarloTreeSearch::calc_cur_value);
+    std::shared_ptr<EnvCrossroads> env = VehicleBase::env;
 
     VehicleList vehicles;
+    std::shared_ptr<PredictionCache> prediction_cache = std::make_shared<PredictionCache>();
+    std::shared_ptr<PlanningContext> planning_context = std::make_shared<PlanningContext>(config);
+    std::shared_ptr<ThreadPool> thread_pool = std::make_shared<ThreadPool>(threads_num);
+    spdlog::info(fmt::format("planner thread pool size: {}, seed: {}", thread_pool->size(), seed));
+    std::shared_ptr<TraceRecorder> trace;
+    if (!trace_path.empty()) {
+        trace = std::make_shared<TraceRecorder>();
+    }
+    // drawing runs beside the simulation, a step only copies its frame
+    std::unique_ptr<FrameRenderer> renderer = std::make_unique<FrameRenderer>(env, save_fig, save_path);
     for (const auto& yaml_node : config["vehicle_list"]) {
         std::string vehicle_name = yaml_node.first.as<std::string>();
-        std::shared_ptr<Vehicle> vehicle = std::make_shared<Vehicle>(vehicle_name, config);
+        std::shared_ptr<Vehicle> vehicle = std::make_shared<Vehicle>(vehicle_name, config, planning_context);
+        vehicle->set_prediction_cache(prediction_cache);
+        vehicle->set_thread_pool(thread_pool);
+        vehicle->set_trace(trace);
         vehicles.push_back(vehicle);
     }
 
     uint64_t succeed_count = 0;
-    for (uint64_t iter = 0; iter < rounds_num; ++iter) {
+    // the initial state and every state a vehicle moved to, for the round summary
+    std::vector<std::vector<State>> footprints(vehicles.size());
+    for (uint64_t iter = 0; iter < static_cast<uint64_t>(rounds_num); ++iter) {
+        // round -> step -> vehicle -> search, the same seed replays the same decisions
+        uint64_t round_seed = Random::derive(seed, iter);
+        Random::seed(round_seed);
         vehicles.reset();
+        for (size_t idx = 0; idx < vehicles.size(); ++idx) {
+            footprints[idx].assign(1, vehicles[idx]->state);
+        }
 
         spdlog::info(fmt::format("================== Round {} ==================", iter));
         for (auto vehicle : vehicles) {
@@ -74,6 +175,9 @@ void run(int rounds_num, std::filesystem::path config_path,
         }
 
         double timestamp = 0.0;
+        int step = 0;
+        std::unique_ptr<TrajectoryLogWriter> trajectory_log =
+            open_trajectory_log(record_path, config, vehicles, iter, round_seed);
         TicToc total_cost_time;
         while (true) {
             if (vehicles.is_all_get_target()) {
@@ -92,71 +196,274 @@ void run(int rounds_num, std::filesystem::path config_path,
             }
 
             TicToc iter_cost_time;
-            std::vector<std::thread> threads;
-            for (std::shared_ptr<Vehicle>& vehicle : vehicles) {
-                std::thread thread([&vehicle, &vehicles]() {
-                    vehicle->excute(vehicles.exclude(vehicle));
-                });
-                threads.emplace_back(std::move(thread));
+            prediction_cache->clear();
+            TraceEvent step_event;
+            if (trace) {
+                trace->set_step(iter, step);
+                step_event = trace->begin(TraceCategory::STEP, "", "", 0);
             }
-
-            for (auto& thread : threads) {
-                if (thread.joinable()) {
-                    thread.join();
+            step_vehicles(vehicles, *thread_pool, Random::derive(round_seed, step));
+            for (size_t idx = 0; idx < vehicles.size(); ++idx) {
+                if (vehicles[idx]->last_step().moved) {
+                    footprints[idx].push_back(vehicles[idx]->state);
                 }
             }
+            if (trace) {
+                step_event.cache_hits = prediction_cache->hit_count();
+                step_event.cache_misses = prediction_cache->miss_count();
+                trace->end(step_event);
+            }
+            if (trajectory_log) {
+                trajectory_log->append(step + 1, timestamp + delta_t, iter_cost_time.toc(),
+                    prediction_cache->hit_count(), prediction_cache->miss_count(), vehicles);
+            }
 
             spdlog::debug(fmt::format(
                 "simulation time {:.3f} step cost {:.3f} sec", timestamp, iter_cost_time.toc()));  
+            spdlog::debug(fmt::format("prediction cache hit {} miss {}",
+                prediction_cache->hit_count(), prediction_cache->miss_count()));
+            for (std::shared_ptr<Vehicle> vehicle : vehicles) {
+                spdlog::debug(fmt::format("{} searched {} iterations", vehicle->name, vehicle->planned_iterations()));
+            }
 
             if (show_animation) {
-                plt::cla();
-                env->draw_env();
-                for (std::shared_ptr<Vehicle> vehicle : vehicles) {
-                    auto excepted_traj = vehicle->excepted_traj.to_vector();
-                    vehicle->draw_vehicle();
-                    plt::plot({vehicle->target.x}, {vehicle->target.y}, {{"marker", "x"}, {"color", vehicle->color}});
-                    plt::plot(excepted_traj[0], excepted_traj[1], {{"color", vehicle->color}, {"linewidth", "1"}});
-                    plt::text(vehicle->vis_text_pos.x, vehicle->vis_text_pos.y + 3,
-                                fmt::format("level {:d}", vehicle->level), {{"color", vehicle->color}});
-                    plt::text(vehicle->vis_text_pos.x, vehicle->vis_text_pos.y,
-                                fmt::format("v = {:.2f} m/s", vehicle->state.v), {{"color", vehicle->color}});
-                    plt::text(vehicle->vis_text_pos.x, vehicle->vis_text_pos.y - 3,
-                                fmt::format("{}", utils::get_action_name(vehicle->cur_action)), {{"color", vehicle->color}});
-                }
-                plt::xlim(-map_size, map_size);
-                plt::ylim(-map_size, map_size);
-                plt::title(fmt::format("Round {} / {}", iter + 1, rounds_num));
-                plt::set_aspect_equal();
-                plt::pause(0.01);
+                renderer->push(Frame::capture(Frame::Kind::STEP, vehicles, iter, rounds_num));
             }
             timestamp += delta_t;
+            ++step;
         }
 
-        plt::clf();
-        env->draw_env();
+        renderer->push(Frame::capture(Frame::Kind::ROUND_SUMMARY, vehicles, iter, rounds_num, footprints));
+    }
+
+    if (trace && trace->save(trace_path.string())) {
+        spdlog::info(fmt::format("{} trace spans saved to {}", trace->size(), trace_path.string()));
+    }
+
+    if (renderer->dropped_count() > 0) {
+        spdlog::debug(fmt::format("renderer fell behind, {} step frames dropped", renderer->dropped_count()));
+    }
+    spdlog::debug(fmt::format("{} prediction searches set up", planning_context->searches_created()));
+    // the last frames are drawn before the summary
+    renderer.reset();
+
+    double succeed_rate = 100 * succeed_count / rounds_num;
+    spdlog::info("\n=========================================");
+    spdlog::info(fmt::format("Experiment success {}/{}({:.2f}%) rounds.", succeed_count, rounds_num, succeed_rate));
+}
+
+enum class RoundOutcome {SUCCESS, COLLISION, TIMEOUT};
+
+struct RoundResult {
+    RoundOutcome outcome;
+    double simulation_time;
+    // wall time of every step, taken while the other rounds of the batch share the pool
+    std::vector<double> step_costs;
+};
 
-        for (std::shared_ptr<Vehicle>& vehicle : vehicles) {
-            for (const State& state : vehicle->footprint) {
-                vehicle->state = state;
-                vehicle->draw_vehicle(true);
+static RoundResult run_round(const YAML::Node& config, int round, uint64_t round_seed, ThreadPool& thread_pool,
+                             std::shared_ptr<PlanningContext> planning_context,
+                             const std::filesystem::path& record_path) {
+    double delta_t = config["delta_t"].as<double>();
+    double max_simulation_time = config["max_simulation_time"].as<double>();
+
+    // rounds run side by side, each one owns its vehicles and prediction cache, they share the planning context
+    Random::Stream stream(round_seed);
+    VehicleList vehicles;
+    std::shared_ptr<PredictionCache> prediction_cache = std::make_shared<PredictionCache>();
+    for (const auto& yaml_node : config["vehicle_list"]) {
+        std::shared_ptr<Vehicle> vehicle = std::make_shared<Vehicle>(yaml_node.first.as<std::string>(), config,
+                                                                     planning_context);
+        vehicle->set_prediction_cache(prediction_cache);
+        vehicles.push_back(vehicle);
+    }
+
+    std::unique_ptr<TrajectoryLogWriter> trajectory_log =
+        open_trajectory_log(record_path, config, vehicles, round, round_seed);
+    RoundResult result{RoundOutcome::TIMEOUT, 0.0, {}};
+    for (int step = 0; ; ++step) {
+        if (vehicles.is_all_get_target()) {
+            result.outcome = RoundOutcome::SUCCESS;
+            break;
+        }
+        if (vehicles.is_any_collision()) {
+            result.outcome = RoundOutcome::COLLISION;
+            break;
+        }
+        if (result.simulation_time > max_simulation_time) {
+            break;
+        }
+
+        TicToc iter_cost_time;
+        prediction_cache->clear();
+        step_vehicles(vehicles, thread_pool, Random::derive(round_seed, step));
+        result.step_costs.push_back(iter_cost_time.toc());
+        result.simulation_time += delta_t;
+        if (trajectory_log) {
+            trajectory_log->append(step + 1, result.simulation_time, result.step_costs.back(),
+                prediction_cache->hit_count(), prediction_cache->miss_count(), vehicles);
+        }
+    }
+
+    return result;
+}
+
+void batch_run(int rounds_num, std::filesystem::path config_path, int threads_num, uint64_t seed,
+               std::filesystem::path record_path) {
+    YAML::Node config;
+    if (!load_config(config_path, config)) {
+        return ;
+    }
+
+    ThreadPool thread_pool(threads_num);
+    std::shared_ptr<PlanningContext> planning_context = std::make_shared<PlanningContext>(config);
+    spdlog::info(fmt::format("batch of {} rounds, thread pool size: {}, seed: {}",
+                             rounds_num, thread_pool.size(), seed));
+
+    TicToc total_cost_time;
+    std::vector<std::future<RoundResult>> rounds;
+    for (int iter = 0; iter < rounds_num; ++iter) {
+        uint64_t round_seed = Random::derive(seed, iter);
+        rounds.emplace_back(thread_pool.submit(
+            [&config, iter, round_seed, &thread_pool, planning_context, &record_path]() {
+            return run_round(config, iter, round_seed, thread_pool, planning_context, record_path);
+        }));
+    }
+
+    uint64_t succeed_count = 0;
+    uint64_t collision_count = 0;
+    uint64_t timeout_count = 0;
+    std::vector<double> step_costs;
+    for (int iter = 0; iter < rounds_num; ++iter) {
+        RoundResult result = thread_pool.wait(rounds[iter]);
+        const char* outcome = "successed";
+        if (result.outcome == RoundOutcome::SUCCESS) {
+            ++succeed_count;
+        } else if (result.outcome == RoundOutcome::COLLISION) {
+            ++collision_count;
+            outcome = "collided";
+        } else {
+            ++timeout_count;
+            outcome = "timeout";
+        }
+        spdlog::debug(fmt::format("Round {:d} {}, simulation time: {:.3f} s",
+                                  iter, outcome, result.simulation_time));
+        step_costs.insert(step_costs.end(), result.step_costs.begin(), result.step_costs.end());
+    }
+
+    auto percentile = [&step_costs](double ratio) {
+        if (step_costs.empty()) {
+            return 0.0;
+        }
+        size_t idx = std::min(static_cast<size_t>(ratio * step_costs.size()), step_costs.size() - 1);
+        std::nth_element(step_costs.begin(), step_costs.begin() + idx, step_costs.end());
+        return step_costs[idx];
+    };
+
+    spdlog::debug(fmt::format("{} prediction searches set up", planning_context->searches_created()));
+    spdlog::info("\n=========================================");
+    spdlog::info(fmt::format("Batch of {} rounds finished in {:.3f} s", rounds_num, total_cost_time.toc()));
+    spdlog::info(fmt::format("success {} ({:.2f}%), collision {} ({:.2f}%), timeout {} ({:.2f}%)",
+                             succeed_count, 100.0 * succeed_count / rounds_num,
+                             collision_count, 100.0 * collision_count / rounds_num,
+                             timeout_count, 100.0 * timeout_count / rounds_num));
+    // the rounds compete for the pool, only -t 1 gives the planning cost of one step alone
+    size_t concurrent_rounds = std::min<size_t>(rounds_num, thread_pool.size());
+    spdlog::info(fmt::format("{} steps, step wall time with up to {} rounds at once on {} threads: "
+                             "p50 {:.3f} p90 {:.3f} p99 {:.3f} max {:.3f} sec",
+                             step_costs.size(), concurrent_rounds, thread_pool.size(), percentile(0.5),
+                             percentile(0.9), percentile(0.99), percentile(1.0)));
+}
+
+// Draws a recorded round again and prints what it did, nothing is planned.
+void replay(std::filesystem::path log_path, std::filesystem::path config_path, std::filesystem::path save_path,
+    bool show_animation, bool save_fig) {
+    YAML::Node config;
+    if (!load_config(config_path, config)) {
+        return ;
+    }
+    TrajectoryLogReader log;
+    if (!log.open(log_path.string()) || log.ticks() == 0) {
+        spdlog::error(fmt::format("nothing to replay in {}", log_path.string()));
+        return ;
+    }
+    const TrajectoryLogHeader& header = log.header();
+    size_t agents_num = log.agents();
+    size_t last_tick = log.ticks() - 1;
+    spdlog::info(fmt::format("replay round {} of seed {}, {} agents, {} steps",
+                             header.round, header.seed, agents_num, last_tick));
+
+    std::unique_ptr<FrameRenderer> renderer = std::make_unique<FrameRenderer>(VehicleBase::env, save_fig, save_path);
+    auto make_frame = [&log, &header, agents_num](Frame::Kind kind, size_t tick) {
+        Frame frame;
+        frame.kind = kind;
+        frame.round = static_cast<int>(header.round);
+        frame.rounds_num = static_cast<int>(header.round) + 1;
+        for (size_t agent = 0; agent < agents_num; ++agent) {
+            const TrajectoryLogAgent& info = log.agent(agent);
+            const TrajectoryLogRecord& record = log.record(tick, agent);
+            VehicleFrame vehicle;
+            vehicle.name = info.name;
+            vehicle.color = info.color;
+            vehicle.level = info.level;
+            vehicle.state = record.state;
+            vehicle.target = info.target;
+            vehicle.text_pos = info.text_pos;
+            vehicle.action = static_cast<Action>(record.action);
+            if (kind == Frame::Kind::STEP) {
+                const State* planned = log.planned(tick, agent);
+                vehicle.excepted_traj = StateList(std::vector<State>(planned, planned + record.traj_len));
+            } else {
+                for (size_t idx = 0; idx <= tick; ++idx) {
+                    if (idx == 0 || log.record(idx, agent).moved) {
+                        vehicle.footprint.push_back(log.record(idx, agent).state);
+                    }
+                }
+            }
+            frame.vehicles.emplace_back(std::move(vehicle));
+        }
+        return frame;
+    };
+
+    double min_distance = std::numeric_limits<double>::max();
+    double step_cost = 0.0;
+    std::vector<double> distances(agents_num, 0.0);
+    std::vector<uint64_t> iterations(agents_num, 0);
+    for (size_t tick = 0; tick <= last_tick; ++tick) {
+        step_cost += log.tick(tick).step_cost;
+        for (size_t agent = 0; agent < agents_num; ++agent) {
+            const TrajectoryLogRecord& record = log.record(tick, agent);
+            iterations[agent] += record.iterations;
+            if (tick > 0) {
+                const State& last = log.record(tick - 1, agent).state;
+                distances[agent] += std::hypot(record.state.x - last.x, record.state.y - last.y);
+            }
+            for (size_t other = agent + 1; other < agents_num; ++other) {
+                const State& other_state = log.record(tick, other).state;
+                min_distance = std::min(min_distance,
+                    std::hypot(record.state.x - other_state.x, record.state.y - other_state.y));
             }
-            plt::text(vehicle->vis_text_pos.x, vehicle->vis_text_pos.y + 3,
-                        fmt::format("level {:d}", vehicle->level), {{"color", vehicle->color}});
         }
-        plt::xlim(-map_size, map_size);
-        plt::ylim(-map_size, map_size);
-        plt::title(fmt::format("Round {} / {}", iter + 1, rounds_num));
-        plt::set_aspect_equal();
-        plt::pause(1);
-        if (save_fig) {
-            plt::save((save_path / ( "Round_" + std::to_string(iter) + ".svg")).string(), 600);
+        if (show_animation && tick > 0) {
+            renderer->push(make_frame(Frame::Kind::STEP, tick));
         }
     }
+    renderer->push(make_frame(Frame::Kind::ROUND_SUMMARY, last_tick));
+    renderer.reset();
 
-    double succeed_rate = 100 * succeed_count / rounds_num;
+    size_t reached_num = 0;
+    for (size_t agent = 0; agent < agents_num; ++agent) {
+        const TrajectoryLogRecord& record = log.record(last_tick, agent);
+        reached_num += record.reached;
+        spdlog::info(fmt::format("{} >>> reached: {}, distance: {:.2f} m, final v: {:.2f} m/s, iterations: {}",
+                                 log.agent(agent).name, record.reached != 0, distances[agent],
+                                 record.state.v, iterations[agent]));
+    }
     spdlog::info("\n=========================================");
-    spdlog::info(fmt::format("Experiment success {}/{}({:.2f}%) rounds.", succeed_count, rounds_num, succeed_rate));
+    spdlog::info(fmt::format("{}/{} agents reached, simulation time: {:.3f} s, min gap: {:.2f} m, "
+                             "recorded step cost: {:.3f} s", reached_num, agents_num,
+                             log.tick(last_tick).simulation_time,
+                             agents_num > 1 ? min_distance : 0.0, step_cost));
 }
 
 int main(int argc, char** argv) {
@@ -168,10 +475,17 @@ int main(int argc, char** argv) {
     std::filesystem::path config_path = "unprotected_left_turn.yaml";
     bool show_animation = true;
     bool save_flag = false;
+    bool batch_mode = false;
+    std::filesystem::path trace_path;
+    std::filesystem::path record_path;
+    std::filesystem::path replay_path;
     std::string log_level = "info";     // info
+    int threads_num = std::max(static_cast<int>(std::thread::hardware_concurrency()), 1);
+    uint64_t seed = std::random_device{}();
+    ScenarioSpec scenario{0, {1.0, 1.0, 1.0}, 0};
 
     int opt, option_index = 0;
-    while ((opt = getopt_long(argc, argv, "r:o:l:c:n:f:", long_options, &option_index)) != -1) {
+    while ((opt = getopt_long(argc, argv, "r:o:l:c:n:f:t:bp:s:w:y:g:k:", long_options, &option_index)) != -1) {
         switch (opt) {
             case 'r':
                 rounds_num = std::stoi(optarg);
@@ -191,6 +505,37 @@ int main(int argc, char** argv) {
             case 'f':
                 save_flag = true;
                 break;
+            case 't':
+                threads_num = std::stoi(optarg);
+                break;
+            case 'b':
+                batch_mode = true;
+                break;
+            case 'p':
+                trace_path = optarg;
+                break;
+            case 's':
+                seed = std::stoull(optarg);
+                break;
+            case 'w':
+                record_path = utils::absolute_path(optarg);
+                break;
+            case 'y':
+                replay_path = utils::absolute_path(optarg);
+                break;
+            case 'g':
+                scenario.vehicles_num = std::stoi(optarg);
+                break;
+            case 'k': {
+                // weights of levels 0, 1, 2 such as "1,2,1"
+                std::stringstream weights(optarg);
+                std::string weight;
+                scenario.level_mix.clear();
+                while (std::getline(weights, weight, ',')) {
+                    scenario.level_mix.push_back(std::stod(weight));
+                }
+                break;
+            }
             default:
                 exit(EXIT_FAILURE);
         }
@@ -217,7 +562,26 @@ int main(int argc, char** argv) {
         }
     }
 
-    run(rounds_num, config_path, output_path, show_animation, save_flag);
+    if (scenario.vehicles_num > 0) {
+        scenario.seed = seed;
+        config_path = write_scenario(config_path, output_path, scenario);
+        if (config_path.empty()) {
+            return EXIT_FAILURE;
+        }
+    }
+
+    if (!record_path.empty() && !std::filesystem::exists(record_path)) {
+        std::filesystem::create_directories(record_path);
+    }
+
+    if (!replay_path.empty()) {
+        replay(replay_path, config_path, output_path, show_animation, save_flag);
+    } else if (batch_mode) {
+        batch_run(rounds_num, config_path, threads_num, seed, record_path);
+    } else {
+        run(rounds_num, config_path, output_path, show_animation, save_flag, threads_num, trace_path, seed,
+            record_path);
+    }
 
     return 0;
 }
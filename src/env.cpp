@@ -1,11 +1,14 @@
-#include <matplotlib-cpp/matplotlibcpp.h>
+#include <cmath>
+#include <limits>
+#include <algorithm>
+#include <fmt/core.h>
+#include <spdlog/spdlog.h>
 
 #include "env.hpp"
+#include "utils.hpp"
 
-namespace plt = matplotlibcpp;
-
-EnvCrossroads::EnvCrossroads(double size, double width) :
-    map_size(size), lanewidth(width)
+CrossroadsTile::CrossroadsTile(double size, double width, double resolution) :
+    grid_cols(0), grid_rows(0), grid_origin(0.0), grid_inv_resolution(0.0), map_size(size), lanewidth(width), grid_resolution(resolution)
 {
    rect = {
         {{-size, -size, -2*lanewidth, -lanewidth, -lanewidth, -size},
@@ -27,8 +30,8 @@ EnvCrossroads::EnvCrossroads(double size, double width) :
 
     for (const std::vector<std::vector<double>>& r : rect) {
         Eigen::MatrixXd mat(r.size(), r[0].size());
-        for (int i = 0; i < r.size(); ++i) {
-            for (int j = 0; j < r[0].size(); ++j) {
+        for (size_t i = 0; i < r.size(); ++i) {
+            for (size_t j = 0; j < r[0].size(); ++j) {
                 mat(i, j) = r[i][j];
             }
         }
@@ -37,32 +40,351 @@ EnvCrossroads::EnvCrossroads(double size, double width) :
     
     for (const std::vector<std::vector<double>>& l : laneline) {
         Eigen::MatrixXd mat(l.size(), l[0].size());
-        for (int i = 0; i < l.size(); ++i) {
-            for (int j = 0; j < l[0].size(); ++j) {
+        for (size_t i = 0; i < l.size(); ++i) {
+            for (size_t j = 0; j < l[0].size(); ++j) {
                 mat(i, j) = l[i][j];
             }
         }
         laneline_mat.emplace_back(mat);
     }
+
+    if (grid_resolution <= 0.0) {
+        return ;
+    }
+
+    // vehicles may leave the tile a little; beyond the grid the exact distances are used
+    double margin = 2 * lanewidth;
+    grid_origin = -(map_size + margin);
+    grid_inv_resolution = 1.0 / grid_resolution;
+    grid_cols = static_cast<int>(std::ceil(2 * (map_size + margin) / grid_resolution)) + 1;
+    grid_rows = grid_cols;
+    offroad_field.resize(grid_rows * grid_cols);
+    laneline_field.resize(grid_rows * grid_cols);
+    lane_direction_grid.resize((grid_rows - 1) * (grid_cols - 1));
+    for (int row = 0; row < grid_rows; ++row) {
+        double y = grid_origin + row * grid_resolution;
+        for (int col = 0; col < grid_cols; ++col) {
+            double x = grid_origin + col * grid_resolution;
+            offroad_field[row * grid_cols + col] = static_cast<float>(calc_offroad_distance(x, y));
+            laneline_field[row * grid_cols + col] = static_cast<float>(calc_laneline_distance(x, y));
+            if (row + 1 < grid_rows && col + 1 < grid_cols) {
+                lane_direction_grid[row * (grid_cols - 1) + col] =
+                    calc_lane_direction(x + grid_resolution / 2, y + grid_resolution / 2);
+            }
+        }
+    }
 }
 
-void EnvCrossroads::draw_env(void)
-{
-    plt::fill(rect[0][0], rect[0][1], {{"color", "#BFBFBF"}});
-    plt::fill(rect[1][0], rect[1][1], {{"color", "#BFBFBF"}});
-    plt::fill(rect[2][0], rect[2][1], {{"color", "#BFBFBF"}});
-    plt::fill(rect[3][0], rect[3][1], {{"color", "#BFBFBF"}});
-    plt::plot(rect[0][0], rect[0][1], {{"color", "k"}, {"linewidth", "2"}});
-    plt::plot(rect[1][0], rect[1][1], {{"color", "k"}, {"linewidth", "2"}});
-    plt::plot(rect[2][0], rect[2][1], {{"color", "k"}, {"linewidth", "2"}});
-    plt::plot(rect[3][0], rect[3][1], {{"color", "k"}, {"linewidth", "2"}});
-
-    plt::plot(laneline[0][0], laneline[0][1],
-        {{"color", "orange"}, {"linewidth", "2"}, {"linestyle", "--"}});
-    plt::plot(laneline[1][0], laneline[1][1],
-        {{"color", "orange"}, {"linewidth", "2"}, {"linestyle", "--"}});
-    plt::plot(laneline[2][0], laneline[2][1],
-        {{"color", "orange"}, {"linewidth", "2"}, {"linestyle", "--"}});
-    plt::plot(laneline[3][0], laneline[3][1],
-        {{"color", "orange"}, {"linewidth", "2"}, {"linestyle", "--"}});
+static double calc_segment_distance(double x, double y, double x0, double y0, double x1, double y1) {
+    double dx = x1 - x0;
+    double dy = y1 - y0;
+    double len2 = dx * dx + dy * dy;
+    double t = len2 > 0.0 ? std::clamp(((x - x0) * dx + (y - y0) * dy) / len2, 0.0, 1.0) : 0.0;
+
+    return std::hypot(x - x0 - t * dx, y - y0 - t * dy);
+}
+
+double CrossroadsTile::calc_offroad_distance(double x, double y) const {
+    // rect polygons are convex, closed and disjoint
+    double outside_distance = std::numeric_limits<double>::infinity();
+    for (const std::vector<std::vector<double>>& r : rect) {
+        const std::vector<double>& xs = r[0];
+        const std::vector<double>& ys = r[1];
+        bool has_left = false;
+        bool has_right = false;
+        double edge_distance = std::numeric_limits<double>::infinity();
+        for (size_t idx = 1; idx < xs.size(); ++idx) {
+            double cross = (xs[idx] - xs[idx - 1]) * (y - ys[idx - 1]) - (ys[idx] - ys[idx - 1]) * (x - xs[idx - 1]);
+            has_left = has_left || cross > 0.0;
+            has_right = has_right || cross < 0.0;
+            edge_distance = std::min(edge_distance,
+                calc_segment_distance(x, y, xs[idx - 1], ys[idx - 1], xs[idx], ys[idx]));
+        }
+        if (!(has_left && has_right)) {
+            return -edge_distance;
+        }
+        outside_distance = std::min(outside_distance, edge_distance);
+    }
+
+    return outside_distance;
+}
+
+double CrossroadsTile::calc_laneline_distance(double x, double y) const {
+    double distance = std::numeric_limits<double>::infinity();
+    for (const std::vector<std::vector<double>>& l : laneline) {
+        distance = std::min(distance, calc_segment_distance(x, y, l[0][0], l[1][0], l[0][1], l[1][1]));
+    }
+
+    return distance;
+}
+
+LaneDirection CrossroadsTile::calc_lane_direction(double x, double y) const {
+    if (x > -lanewidth && x < 0 && (y < -lanewidth || y > lanewidth)) {
+        return LaneDirection::DOWN;
+    } else if (x > 0 && x < lanewidth && (y < -lanewidth || y > lanewidth)) {
+        return LaneDirection::UP;
+    } else if (y > -lanewidth && y < 0 && (x < -lanewidth || x > lanewidth)) {
+        return LaneDirection::RIGHT;
+    } else if (y > 0 && y < lanewidth && (x < -lanewidth || x > lanewidth)) {
+        return LaneDirection::LEFT;
+    }
+
+    return LaneDirection::NONE;
+}
+
+double CrossroadsTile::sample_field(const std::vector<float>& field, double x, double y, bool& in_grid) const {
+    double fx = (x - grid_origin) * grid_inv_resolution;
+    double fy = (y - grid_origin) * grid_inv_resolution;
+    in_grid = fx >= 0.0 && fy >= 0.0 && fx < grid_cols - 1 && fy < grid_rows - 1;
+    if (!in_grid) {
+        return 0.0;
+    }
+
+    // bilinear
+    int col = static_cast<int>(fx);
+    int row = static_cast<int>(fy);
+    double tx = fx - col;
+    double ty = fy - row;
+    const float* cell = &field[row * grid_cols + col];
+    double bottom = cell[0] + tx * (cell[1] - cell[0]);
+    double top = cell[grid_cols] + tx * (cell[grid_cols + 1] - cell[grid_cols]);
+
+    return bottom + ty * (top - bottom);
+}
+
+template <typename DistanceFunc, typename ExactFunc>
+bool CrossroadsTile::is_box_touched(const Eigen::Matrix<double, 2, 5>& box2d, DistanceFunc distance,
+                                   ExactFunc exact) const {
+    // The fields are 1-Lipschitz and a bilinear sample is off by at most the distance
+    // to the farthest cell corner, sqrt(2) cells, plus float rounding. So a side is
+    // clear once the sampled distances at its ends, less that error, add up to more
+    // than its length. Sides that run close to a boundary are halved down to the grid
+    // resolution, whatever is still in doubt then goes to the exact test.
+    constexpr int MAX_DEPTH = 16;
+    struct Side {
+        double x0, y0, d0, x1, y1, d1;
+        int depth;
+    };
+    // depth first, so at most one pending half per level besides the four sides
+    Side stack[4 + MAX_DEPTH];
+    int stack_size = 0;
+    double error = 1.5 * grid_resolution;
+    double corner_distance[4];
+    for (int idx = 0; idx < 4; ++idx) {
+        corner_distance[idx] = distance(box2d(0, idx), box2d(1, idx));
+        if (corner_distance[idx] < -error) {
+            return true;
+        }
+    }
+    for (int idx = 0; idx < 4; ++idx) {
+        int next = (idx + 1) % 4;
+        stack[stack_size++] = {box2d(0, idx), box2d(1, idx), corner_distance[idx],
+                               box2d(0, next), box2d(1, next), corner_distance[next], 0};
+    }
+
+    while (stack_size > 0) {
+        Side side = stack[--stack_size];
+        double length = std::sqrt((side.x1 - side.x0) * (side.x1 - side.x0) + (side.y1 - side.y0) * (side.y1 - side.y0));
+        if (side.d0 + side.d1 - 2 * error > length) {
+            continue;
+        }
+        if (length < grid_resolution || side.depth == MAX_DEPTH) {
+            return exact();
+        }
+        double xm = (side.x0 + side.x1) / 2;
+        double ym = (side.y0 + side.y1) / 2;
+        double dm = distance(xm, ym);
+        if (dm < -error) {
+            return true;
+        }
+        stack[stack_size++] = {side.x0, side.y0, side.d0, xm, ym, dm, side.depth + 1};
+        stack[stack_size++] = {xm, ym, dm, side.x1, side.y1, side.d1, side.depth + 1};
+    }
+
+    return false;
+}
+
+bool CrossroadsTile::is_offroad_exact(const Eigen::Matrix<double, 2, 5>& box2d) const {
+    for (const Eigen::MatrixXd& r : rect_mat) {
+        if (utils::has_overlap(box2d, r)) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+bool CrossroadsTile::is_on_laneline_exact(const Eigen::Matrix<double, 2, 5>& box2d) const {
+    for (const Eigen::MatrixXd& l : laneline_mat) {
+        if (utils::has_overlap(box2d, l)) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+bool CrossroadsTile::is_offroad(const Eigen::Matrix<double, 2, 5>& box2d) const {
+    if (!has_grid()) {
+        return is_offroad_exact(box2d);
+    }
+
+    return is_box_touched(box2d, [this](double x, double y) {
+        bool in_grid;
+        double d = sample_field(offroad_field, x, y, in_grid);
+        return in_grid ? d : calc_offroad_distance(x, y);
+    }, [this, &box2d]() { return is_offroad_exact(box2d); });
+}
+
+bool CrossroadsTile::is_on_laneline(const Eigen::Matrix<double, 2, 5>& box2d) const {
+    if (!has_grid()) {
+        return is_on_laneline_exact(box2d);
+    }
+
+    // the lines are longer than any box, so a box touches one only across its sides
+    return is_box_touched(box2d, [this](double x, double y) {
+        bool in_grid;
+        double d = sample_field(laneline_field, x, y, in_grid);
+        return in_grid ? d : calc_laneline_distance(x, y);
+    }, [this, &box2d]() { return is_on_laneline_exact(box2d); });
+}
+
+LaneDirection CrossroadsTile::get_lane_direction(double x, double y) const {
+    if (has_grid()) {
+        int col = static_cast<int>(std::floor((x - grid_origin) / grid_resolution));
+        int row = static_cast<int>(std::floor((y - grid_origin) / grid_resolution));
+        if (col >= 0 && row >= 0 && col < grid_cols - 1 && row < grid_rows - 1) {
+            return lane_direction_grid[row * (grid_cols - 1) + col];
+        }
+    }
+
+    return calc_lane_direction(x, y);
+}
+
+EnvCrossroads::EnvCrossroads(double size, double width, double resolution,
+                             const std::vector<std::array<int, 2>>& _tiles) :
+    tile(size, width, resolution), tiles(_tiles), pitch(2 * size), min_col(0), min_row(0), cols(0), rows(0),
+    map_size(size), lanewidth(width), grid_resolution(resolution) {
+    index_tiles();
+}
+
+static std::vector<std::array<int, 2>> load_tiles(const YAML::Node& cfg) {
+    std::vector<std::array<int, 2>> tiles;
+    if (!cfg["map_tiles"]) {
+        tiles.push_back({0, 0});
+        return tiles;
+    }
+    for (const YAML::Node& cell : cfg["map_tiles"]) {
+        tiles.push_back({cell[0].as<int>(), cell[1].as<int>()});
+    }
+
+    return tiles;
+}
+
+EnvCrossroads::EnvCrossroads(const YAML::Node& cfg) :
+    EnvCrossroads(cfg["map_size"].as<double>(), cfg["lane_width"].as<double>(),
+                  cfg["grid_resolution"] ? cfg["grid_resolution"].as<double>() : 0.0, load_tiles(cfg)) {}
+
+void EnvCrossroads::index_tiles(void) {
+    if (tiles.empty()) {
+        spdlog::error("map_tiles has no tile, fall back to one crossroads at [0, 0] !");
+        tiles.push_back({0, 0});
+    }
+    int max_col = tiles[0][0];
+    int max_row = tiles[0][1];
+    min_col = max_col;
+    min_row = max_row;
+    for (const std::array<int, 2>& cell : tiles) {
+        min_col = std::min(min_col, cell[0]);
+        max_col = std::max(max_col, cell[0]);
+        min_row = std::min(min_row, cell[1]);
+        max_row = std::max(max_row, cell[1]);
+    }
+    cols = max_col - min_col + 1;
+    rows = max_row - min_row + 1;
+
+    tile_grid.assign(static_cast<size_t>(cols) * rows, -1);
+    std::vector<std::array<int, 2>> placed;
+    for (const std::array<int, 2>& cell : tiles) {
+        int32_t& slot = tile_grid[(cell[1] - min_row) * cols + (cell[0] - min_col)];
+        if (slot >= 0) {
+            spdlog::error(fmt::format("map_tiles repeats the tile [{}, {}], it is skipped !", cell[0], cell[1]));
+            continue;
+        }
+        slot = static_cast<int32_t>(placed.size());
+        placed.push_back(cell);
+    }
+    tiles.swap(placed);
+}
+
+int EnvCrossroads::col_of(double x) const {
+    int col = static_cast<int>(std::floor((x + map_size) / pitch)) - min_col;
+    return std::clamp(col, 0, cols - 1);
+}
+
+int EnvCrossroads::row_of(double y) const {
+    int row = static_cast<int>(std::floor((y + map_size) / pitch)) - min_row;
+    return std::clamp(row, 0, rows - 1);
+}
+
+template <typename TileQuery>
+bool EnvCrossroads::is_any_tile_touched(const Eigen::Matrix<double, 2, 5>& box2d, TileQuery query,
+                                        bool empty_touched) const {
+    // one crossroads at the origin is its own tile
+    if (tile_grid.size() == 1 && tiles[0][0] == 0 && tiles[0][1] == 0) {
+        return query(box2d);
+    }
+
+    // the tiles under the bounding box, a little slack keeps a box touching an edge on both sides
+    double slack = 1e-9;
+    int col_lo = col_of(box2d.row(0).minCoeff() - slack);
+    int col_hi = col_of(box2d.row(0).maxCoeff() + slack);
+    int row_lo = row_of(box2d.row(1).minCoeff() - slack);
+    int row_hi = row_of(box2d.row(1).maxCoeff() + slack);
+    for (int row = row_lo; row <= row_hi; ++row) {
+        for (int col = col_lo; col <= col_hi; ++col) {
+            int32_t idx = tile_grid[row * cols + col];
+            if (idx < 0) {
+                if (empty_touched) {
+                    return true;
+                }
+                continue;
+            }
+            Eigen::Matrix<double, 2, 5> local = box2d;
+            local.row(0).array() -= tile_x(idx);
+            local.row(1).array() -= tile_y(idx);
+            if (query(local)) {
+                return true;
+            }
+        }
+    }
+
+    return false;
+}
+
+bool EnvCrossroads::contains(double x, double y) const {
+    int32_t idx = tile_grid[row_of(y) * cols + col_of(x)];
+
+    return idx >= 0 && std::abs(x - tile_x(idx)) <= map_size && std::abs(y - tile_y(idx)) <= map_size;
+}
+
+bool EnvCrossroads::is_offroad(const Eigen::Matrix<double, 2, 5>& box2d) const {
+    return is_any_tile_touched(box2d, [this](const Eigen::Matrix<double, 2, 5>& local) {
+        return tile.is_offroad(local);
+    }, true);
+}
+
+bool EnvCrossroads::is_on_laneline(const Eigen::Matrix<double, 2, 5>& box2d) const {
+    return is_any_tile_touched(box2d, [this](const Eigen::Matrix<double, 2, 5>& local) {
+        return tile.is_on_laneline(local);
+    }, false);
+}
+
+LaneDirection EnvCrossroads::get_lane_direction(double x, double y) const {
+    int32_t idx = tile_grid[row_of(y) * cols + col_of(x)];
+    if (idx < 0) {
+        return LaneDirection::NONE;
+    }
+
+    return tile.get_lane_direction(x - tile_x(idx), y - tile_y(idx));
 }
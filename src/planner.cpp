@@ -1,221 +1,839 @@
-#include <unordered_set>
+#include <mutex>
+#include <atomic>
+#include <limits>
+#include <algorithm>
 #include <spdlog/spdlog.h>
 #include <fmt/core.h>
 
 #include "planner.hpp"
 
 constexpr double TWO_PI = M_PI * 2;
+// iterations between two looks at the clock
+constexpr uint64_t DEADLINE_CHECK_INTERVAL = 16;
 
-double MonteCarloTreeSearch::EXPLORATE_RATE = 1 / (2 * sqrt(2.0));
-double MonteCarloTreeSearch::LAMDA = 0.9;
-double MonteCarloTreeSearch::WEIGHT_AVOID = 10;
-double MonteCarloTreeSearch::WEIGHT_SAFE = 0.2;
-double MonteCarloTreeSearch::WEIGHT_OFFROAD = 2;
-double MonteCarloTreeSearch::WEIGHT_DIRECTION = 1;
-double MonteCarloTreeSearch::WEIGHT_DISTANCE = 0.1;
-double MonteCarloTreeSearch::WEIGHT_VELOCITY = 0.05;
-
-double MonteCarloTreeSearch::calc_cur_value(std::shared_ptr<Node> node, double last_node_value) {
-    double x = node->state.x;
-    double y = node->state.y;
-    double yaw = node->state.yaw;
-    double velocity = node->state.v;
-    int step = node->cur_level;
-    Eigen::Matrix<double, 2, 5> ego_box2d = VehicleBase::get_box2d(node->state);
-    Eigen::Matrix<double, 2, 5> ego_safezone = VehicleBase::get_safezone(node->state);
+static bool is_expired(Deadline deadline, uint64_t iter) {
+    return deadline != Deadline::max() && iter % DEADLINE_CHECK_INTERVAL == 0 && iter > 0 &&
+           std::chrono::steady_clock::now() >= deadline;
+}
+
+// adds the time since `since` to `total` in seconds, returns the end of the lap
+static std::chrono::steady_clock::time_point add_lap(std::chrono::steady_clock::time_point since, double& total) {
+    std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+    total += std::chrono::duration<double>(now - since).count();
+    return now;
+}
+
+// node creations and rollout steps are the reward evaluations of an iteration,
+// merged nodes take the reward of their state
+static void count_iteration(SearchStats& stats, size_t new_nodes, size_t merged_nodes, int leaf_level,
+                            int leaf_rollouts) {
+    int rollout_steps = std::max(Node::MAX_LEVEL - leaf_level, 0);
+    ++stats.iterations;
+    stats.nodes_created += new_nodes;
+    stats.nodes_merged += merged_nodes;
+    stats.rollouts += rollout_steps > 0 ? leaf_rollouts : 0;
+    stats.reward_evaluations += new_nodes - merged_nodes + rollout_steps * leaf_rollouts;
+}
+
+static std::array<double, MonteCarloTreeSearchBase::DISCOUNT_TABLE_SIZE> make_discount_table(double lamda) {
+    std::array<double, MonteCarloTreeSearchBase::DISCOUNT_TABLE_SIZE> table;
+    for (size_t k = 0; k < table.size(); ++k) {
+        table[k] = pow(lamda, k);
+    }
+
+    return table;
+}
+
+double MonteCarloTreeSearchBase::EXPLORATE_RATE = 1 / (2 * sqrt(2.0));
+double MonteCarloTreeSearchBase::LAMDA = 0.9;
+double MonteCarloTreeSearchBase::WEIGHT_AVOID = 10;
+double MonteCarloTreeSearchBase::WEIGHT_SAFE = 0.2;
+double MonteCarloTreeSearchBase::WEIGHT_OFFROAD = 2;
+double MonteCarloTreeSearchBase::WEIGHT_DIRECTION = 1;
+double MonteCarloTreeSearchBase::WEIGHT_DISTANCE = 0.1;
+double MonteCarloTreeSearchBase::WEIGHT_VELOCITY = 0.05;
+std::array<double, MonteCarloTreeSearchBase::DISCOUNT_TABLE_SIZE> MonteCarloTreeSearchBase::DISCOUNT =
+    make_discount_table(MonteCarloTreeSearchBase::LAMDA);
+
+double MonteCarloTreeSearchBase::calc_cur_value(Node& node, double last_node_value) {
+    double total_reward = last_node_value + MonteCarloTreeSearchBase::discount(node.cur_level - 1) *
+                          ConfigReward()(node.state, node.cos_yaw, node.sin_yaw, node.goal_pose,
+                                         *node.predictions, node.cur_level);
+    node.value = total_reward;
+
+    return total_reward;
+}
+
+double MonteCarloTreeSearchBase::calc_cur_reward(
+    const State& state, const State& goal, const PredictionTable& others, int level) {
+    return ConfigReward()(state, goal, others, level);
+}
+
+template <typename Weights>
+double WeightedReward<Weights>::operator()(const State& state, double cos_yaw, double sin_yaw,
+                                           const State& goal, const PredictionTable& others, int level) const {
+    double x = state.x;
+    double y = state.y;
+    double yaw = state.yaw;
+    double velocity = state.v;
+    Eigen::Matrix<double, 2, 5> ego_box2d = VehicleBase::get_box2d(state, cos_yaw, sin_yaw);
+    OrientedBox ego_obb = VehicleBase::get_obb(state, cos_yaw, sin_yaw);
+    OrientedBox ego_safezone = VehicleBase::get_safezone_obb(state, cos_yaw, sin_yaw);
 
     int avoid = 0;
+    BoxSpan near_boxes = others.near_boxes(level, ego_obb);
+    if (utils::has_any_overlap(ego_obb, near_boxes.data, near_boxes.size)) {
+        avoid = -1;
+    }
     int safe = 0;
-    for (auto& cur_other_state : node->other_agent_state) {
-        if (utils::has_overlap(ego_box2d, VehicleBase::get_box2d(cur_other_state))) {
-            avoid = -1;
-        }
-        if (utils::has_overlap(ego_safezone, VehicleBase::get_safezone(cur_other_state))) {
-            safe = -1;
-        }
+    BoxSpan near_safezones = others.near_safezones(level, ego_safezone);
+    if (utils::has_any_overlap(ego_safezone, near_safezones.data, near_safezones.size)) {
+        safe = -1;
     }
 
     int offroad = 0;
-    for (auto& rect : VehicleBase::env->rect_mat) {
-        if (utils::has_overlap(ego_box2d, rect)) {
-            offroad = -1;
-            break;
-        }
+    if (VehicleBase::env->is_offroad(ego_box2d)) {
+        offroad = -1;
     }
 
     int direction = 0;
-    if (MonteCarloTreeSearch::is_opposite_direction(node->state, ego_box2d)) {
+    if (MonteCarloTreeSearchBase::is_opposite_direction(state, ego_box2d)) {
         direction = -1;
     }
-    
-    double delta_yaw = std::fmod(abs(yaw - node->goal_pose.yaw), TWO_PI);
-    delta_yaw = std::min(delta_yaw, TWO_PI - delta_yaw);
-    double distance = -(abs(x - node->goal_pose.x) + abs(y - node->goal_pose.y) +
-                        1.5 * delta_yaw);
-
-    double cur_reward = MonteCarloTreeSearch::WEIGHT_AVOID * avoid +
-                        MonteCarloTreeSearch::WEIGHT_SAFE * safe +
-                        MonteCarloTreeSearch::WEIGHT_OFFROAD * offroad +
-                        MonteCarloTreeSearch::WEIGHT_DISTANCE * distance +
-                        MonteCarloTreeSearch::WEIGHT_DIRECTION * direction +
-                        MonteCarloTreeSearch::WEIGHT_VELOCITY * velocity;
-    double total_reward = last_node_value + pow(MonteCarloTreeSearch::LAMDA, (step - 1)) * cur_reward;
-    node->value = total_reward;
 
-    return total_reward;
+    double delta_yaw = std::fmod(abs(yaw - goal.yaw), TWO_PI);
+    delta_yaw = std::min(delta_yaw, TWO_PI - delta_yaw);
+    double distance = -(abs(x - goal.x) + abs(y - goal.y) + 1.5 * delta_yaw);
+
+    return Weights::avoid() * avoid +
+           Weights::safe() * safe +
+           Weights::offroad() * offroad +
+           Weights::distance() * distance +
+           Weights::direction() * direction +
+           Weights::velocity() * velocity;
 }
 
-bool MonteCarloTreeSearch::is_opposite_direction(State pos, Eigen::MatrixXd ego_box2d) {
+bool MonteCarloTreeSearchBase::is_opposite_direction(const State& pos, const Eigen::Matrix<double, 2, 5>& ego_box2d) {
     double x = pos.x;
     double y = pos.y;
     double yaw = pos.yaw;
 
-    for (auto laneline : VehicleBase::env->laneline_mat) {
-        if (utils::has_overlap(ego_box2d, laneline)) {
-            return true;
-        }
+    if (VehicleBase::env->is_on_laneline(ego_box2d)) {
+        return true;
     }
 
-    double lanewidth = VehicleBase::env->lanewidth;
-    if (x > -lanewidth && x < 0 && (y < -lanewidth || y > lanewidth)) {
-        // down lane
-        if (yaw > 0 && yaw < M_PI) {
-            return true;
-        }
-    } else if (x > 0 && x < lanewidth && (y < -lanewidth || y > lanewidth)) {
-        // up lane
-        if (!(yaw > 0 && yaw < M_PI)) {
-            return true;
-        }
-    } else if (y > -lanewidth && y < 0 && (x < -lanewidth || x > lanewidth)) {
-        // right lane
-        if (yaw > M_PI_2 && yaw < 3 * M_PI_2) {
-            return true;
+    switch (VehicleBase::env->get_lane_direction(x, y)) {
+    case LaneDirection::DOWN:
+        return yaw > 0 && yaw < M_PI;
+    case LaneDirection::UP:
+        return !(yaw > 0 && yaw < M_PI);
+    case LaneDirection::RIGHT:
+        return yaw > M_PI_2 && yaw < 3 * M_PI_2;
+    case LaneDirection::LEFT:
+        return !(yaw > M_PI_2 && yaw < 3 * M_PI_2);
+    default:
+        break;
+    }
+
+    return false;
+}
+
+void PredictionTable::assign(const std::vector<StateList>& traj) {
+    agents_num = traj.empty() ? 0 : traj[0].size();
+    steps_num = traj.size();
+    boxes.clear();
+    safezones.clear();
+    centers_x.clear();
+    boxes.reserve(agents_num * steps_num);
+    safezones.reserve(agents_num * steps_num);
+    centers_x.reserve(agents_num * steps_num);
+    box_reach.assign(steps_num, 0.0);
+    safezone_reach.assign(steps_num, 0.0);
+    std::vector<State> sorted;
+    for (size_t level = 0; level < steps_num; ++level) {
+        sorted.assign(traj[level].begin(), traj[level].end());
+        std::sort(sorted.begin(), sorted.end(), [](const State& a, const State& b) { return a.x < b.x; });
+        for (const State& state : sorted) {
+            boxes.push_back(VehicleBase::get_obb(state));
+            safezones.push_back(VehicleBase::get_safezone_obb(state));
+            centers_x.push_back(state.x);
+            box_reach[level] = std::max(box_reach[level], boxes.back().x_extent());
+            safezone_reach[level] = std::max(safezone_reach[level], safezones.back().x_extent());
         }
-    } else if (y > 0 && y < lanewidth && (x < -lanewidth || x > lanewidth)) {
-        // left lane
-        if (!(yaw > M_PI_2 && yaw < 3 * M_PI_2)) {
-            return true;
+    }
+}
+
+BoxSpan PredictionTable::near(
+    const std::vector<OrientedBox>& list, double reach, int level, const OrientedBox& box) const {
+    const OrientedBox* first = list.data() + level * agents_num;
+    if (agents_num < BROAD_PHASE_MIN_AGENTS) {
+        return BoxSpan{first, agents_num};
+    }
+    // a little slack keeps touching boxes with the exact test
+    double range = box.x_extent() + reach + 1e-9;
+    const double* xs = centers_x.data() + level * agents_num;
+    size_t lo = std::lower_bound(xs, xs + agents_num, box.x - range) - xs;
+    size_t hi = std::upper_bound(xs + lo, xs + agents_num, box.x + range) - xs;
+
+    return BoxSpan{first + lo, hi - lo};
+}
+
+template <typename Reward>
+void BasicMonteCarloTreeSearch<Reward>::reset(const std::vector<StateList>& other_traj) {
+    tree.reset();
+    predictions.assign(other_traj);
+}
+
+template <typename Reward>
+NodeId BasicMonteCarloTreeSearch<Reward>::reroot(NodeId node, const std::vector<StateList>& other_traj) {
+    predictions.assign(other_traj);
+    reuse_tree.reset();
+    reuse_tree.reserve(tree.size());
+    copy_subtree(node, INVALID_NODE, tree[node].cur_level, tree[node].value);
+    std::swap(tree, reuse_tree);
+
+    return 0;
+}
+
+template <typename Reward>
+double BasicMonteCarloTreeSearch<Reward>::copy_subtree(NodeId src_id, NodeId dst_parent, int level_offset, double value_offset) {
+    // One level up, returns move to the frame of the new root, r' = (r - value(new root)) / lamda.
+    // Node values are re-evaluated against the new predictions and the change is pushed into
+    // the backed up rewards of every return that passed the node. Returns the subtree's change.
+    static const int REUSE_MIN_VISITS = 2;
+    const Node& src = tree[src_id];
+    NodeId dst_id = reuse_tree.copy_node(src, dst_parent);
+    Node& dst = reuse_tree[dst_id];
+    dst.cur_level -= level_offset;
+    dst.predictions = &predictions;
+    double dst_reward = (src.reward - src.visits * value_offset) / MonteCarloTreeSearchBase::LAMDA;
+
+    double value_change = 0.0;
+    if (dst_parent == INVALID_NODE) {
+        dst.value = 0.0;
+    } else {
+        calc_value(dst, reuse_tree[dst_parent].value);
+        value_change = dst.value - (src.value - value_offset) / MonteCarloTreeSearchBase::LAMDA;
+    }
+
+    // rarely visited leaves are cheaper to expand again than to re-evaluate
+    int ended_here = src.visits;
+    double reward_change = 0.0;
+    for (int k = 0; k < src.children_num; ++k) {
+        NodeId child = tree.children_of(src_id).child[k];
+        if (tree[child].visits >= REUSE_MIN_VISITS) {
+            ended_here -= tree[child].visits;
+            reward_change += copy_subtree(child, dst_id, level_offset, value_offset);
         }
     }
+    reward_change += ended_here * value_change;
 
-    return false;
+    // the rollouts below still saw the old predictions, keep only part of their weight
+    int visits = std::max(1, static_cast<int>(std::round(src.visits * reuse_decay)));
+    reuse_tree.set_stats(dst_id, visits, (dst_reward + reward_change) * visits / src.visits);
+
+    return reward_change;
 }
 
-std::shared_ptr<Node> MonteCarloTreeSearch::excute(std::shared_ptr<Node> root) {
-    for (uint64_t iter = 0; iter < computation_budget; ++iter) {
+template <typename Reward>
+NodeId BasicMonteCarloTreeSearch<Reward>::excute(NodeId root, uint64_t budget, Deadline deadline) {
+    stats = SearchStats();
+    if (search_threads <= 1) {
+        search(tree, root, budget, deadline, stats);
+    } else if (parallel_mode == ParallelMode::TREE) {
+        tree_parallel_search(root, budget, deadline);
+    } else {
+        root_parallel_search(root, budget, deadline);
+    }
+    if (profile) {
+        measure_shape(root);
+    }
+
+    return get_best_child(tree, root, 0);
+}
+
+template <typename Reward>
+void BasicMonteCarloTreeSearch<Reward>::search(
+    NodePool& pool, NodeId root, uint64_t budget, Deadline deadline, SearchStats& search_stats) {
+    std::chrono::steady_clock::time_point phase_start;
+    // the iterations never wait on the pool, so only this search moves the counter meanwhile
+    uint64_t overlap_tests = utils::overlap_tests;
+    for (uint64_t iter = 0; iter < budget && !is_expired(deadline, iter); ++iter) {
+        size_t pool_size = pool.size();
+        uint64_t pool_merged = pool.merged_count();
+        if (profile) {
+            phase_start = std::chrono::steady_clock::now();
+        }
         // 1. Find the best node to expand
-        std::shared_ptr<Node> expand_node = tree_policy(root);
+        NodeId expand_node = tree_policy(pool, root);
+        if (profile) {
+            phase_start = add_lap(phase_start, search_stats.tree_policy_time);
+        }
         // 2. Random run to add node and get reward
-        double reward = default_policy(expand_node);
+        double reward = default_policy(pool[expand_node]);
+        if (profile) {
+            phase_start = add_lap(phase_start, search_stats.default_policy_time);
+        }
         // 3. Update all passing nodes with reward
-        update(expand_node, reward);
+        update(pool, expand_node, leaf_rollouts, reward);
+        if (profile) {
+            add_lap(phase_start, search_stats.update_time);
+        }
+        count_iteration(search_stats, pool.size() - pool_size, pool.merged_count() - pool_merged,
+                        pool[expand_node].cur_level, leaf_rollouts);
+    }
+    search_stats.collision_checks += utils::overlap_tests - overlap_tests;
+}
+
+template <typename Reward>
+void BasicMonteCarloTreeSearch<Reward>::root_parallel_search(NodeId root, uint64_t total_budget, Deadline deadline) {
+    // the calling thread grows `tree` itself, worker threads grow worker_trees
+    worker_trees.resize(search_threads - 1);
+    uint64_t budget = total_budget / search_threads;
+    uint64_t remainder = total_budget % search_threads;
+
+    std::vector<SearchStats> worker_stats(search_threads - 1);
+    std::vector<std::function<void(void)>> helpers;
+    for (int idx = 1; idx < search_threads; ++idx) {
+        unsigned int seed = Random::uniform(0, std::numeric_limits<int>::max());
+        uint64_t worker_budget = budget + (static_cast<uint64_t>(idx) < remainder ? 1 : 0);
+        helpers.emplace_back([this, idx, seed, worker_budget, deadline, &worker_stats, root_node = tree[root]]() {
+            Random::Stream stream(seed);
+            NodePool& pool = worker_trees[idx - 1];
+            pool.reset();
+            search(pool, pool.copy_node(root_node, INVALID_NODE), worker_budget, deadline, worker_stats[idx - 1]);
+        });
     }
+    run_beside(helpers, [&]() { search(tree, root, budget + (remainder > 0 ? 1 : 0), deadline, stats); });
 
-    return get_best_child(root, 0);
+    for (const NodePool& pool : worker_trees) {
+        merge_tree(tree, root, pool, 0);
+    }
+    for (const SearchStats& worker_stat : worker_stats) {
+        stats += worker_stat;
+    }
 }
 
-std::shared_ptr<Node> MonteCarloTreeSearch::tree_policy(std::shared_ptr<Node> node) {
-    while (node->is_terminal() == false) {
-        if (node->children.empty()) {
-            return expand(node);
-        } else if (Random::uniform(0.0, 1.0) < 0.5) {
-            node = get_best_child(node, MonteCarloTreeSearch::EXPLORATE_RATE);
-        } else {
-            if (node->is_fully_expanded() == false) {
-                return expand(node);
-            } else {
-                node = get_best_child(node, MonteCarloTreeSearch::EXPLORATE_RATE);
+template <typename Reward>
+void BasicMonteCarloTreeSearch<Reward>::tree_parallel_search(NodeId root, uint64_t budget, Deadline deadline) {
+    std::mutex tree_mutex;
+    std::atomic<uint64_t> started(0);
+    // the tree only grows under the lock, rollouts work on a copy of the leaf
+    auto worker = [&]() {
+        SearchStats worker_stats;
+        std::chrono::steady_clock::time_point phase_start;
+        uint64_t overlap_tests = utils::overlap_tests;
+        uint64_t iter = 0;
+        while (!is_expired(deadline, iter++) && started.fetch_add(1) < budget) {
+            if (profile) {
+                phase_start = std::chrono::steady_clock::now();
+            }
+            size_t new_nodes = 0;
+            size_t merged_nodes = 0;
+            std::pair<NodeId, Node> leaf = [&]() {
+                std::lock_guard<std::mutex> lock(tree_mutex);
+                size_t tree_size = tree.size();
+                uint64_t tree_merged = tree.merged_count();
+                NodeId expand_node = tree_policy(tree, root);
+                new_nodes = tree.size() - tree_size;
+                merged_nodes = tree.merged_count() - tree_merged;
+                apply_virtual_loss(tree, expand_node, false);
+                return std::make_pair(expand_node, tree[expand_node]);
+            }();
+            if (profile) {
+                phase_start = add_lap(phase_start, worker_stats.tree_policy_time);
+            }
+            double reward = default_policy(leaf.second);
+            if (profile) {
+                phase_start = add_lap(phase_start, worker_stats.default_policy_time);
+            }
+            {
+                std::lock_guard<std::mutex> lock(tree_mutex);
+                apply_virtual_loss(tree, leaf.first, true);
+                update(tree, leaf.first, leaf_rollouts, reward);
             }
+            if (profile) {
+                add_lap(phase_start, worker_stats.update_time);
+            }
+            count_iteration(worker_stats, new_nodes, merged_nodes, leaf.second.cur_level, leaf_rollouts);
         }
+        worker_stats.collision_checks = utils::overlap_tests - overlap_tests;
+        std::lock_guard<std::mutex> lock(tree_mutex);
+        stats += worker_stats;
+    };
+
+    std::vector<std::function<void(void)>> helpers;
+    for (int idx = 1; idx < search_threads; ++idx) {
+        unsigned int seed = Random::uniform(0, std::numeric_limits<int>::max());
+        helpers.emplace_back([&worker, seed]() {
+            Random::Stream stream(seed);
+            worker();
+        });
     }
+    run_beside(helpers, worker);
+}
 
-    return node;
+template <typename Reward>
+void BasicMonteCarloTreeSearch<Reward>::run_beside(std::vector<std::function<void(void)>>& helpers,
+                                                   const std::function<void(void)>& own) {
+    // a waiting pool worker runs the helpers nobody took yet, so nested searches do not block the pool
+    std::vector<std::future<void>> jobs;
+    if (thread_pool) {
+        for (std::function<void(void)>& helper : helpers) {
+            jobs.emplace_back(thread_pool->submit(std::move(helper)));
+        }
+    }
+    own();
+    if (thread_pool) {
+        for (std::future<void>& job : jobs) {
+            thread_pool->wait(job);
+        }
+    } else {
+        for (std::function<void(void)>& helper : helpers) {
+            helper();
+        }
+    }
 }
 
-std::shared_ptr<Node> MonteCarloTreeSearch::expand(std::shared_ptr<Node> node) {
-    std::unordered_set<Action> tried_actions;
-    for (auto child : node->children) {
-        tried_actions.insert(child->action);
+template <typename Reward>
+void BasicMonteCarloTreeSearch<Reward>::measure_shape(NodeId root) {
+    // every node of the arena hangs below the root of the running search
+    int root_level = tree[root].cur_level;
+    std::vector<int> widths(Node::MAX_LEVEL + 1, 0);
+    for (size_t id = 0; id < tree.size(); ++id) {
+        int depth = tree[id].cur_level - root_level;
+        if (depth >= 0 && depth < static_cast<int>(widths.size())) {
+            ++widths[depth];
+            stats.max_depth = std::max(stats.max_depth, depth);
+        }
     }
+    stats.max_width = *std::max_element(widths.begin(), widths.end());
+}
 
-    Action next_action = Random::choice(ACTION_LIST);
-    while (!node->is_terminal() && tried_actions.count(next_action)) {
-        next_action = Random::choice(ACTION_LIST);
+template <typename Reward>
+void BasicMonteCarloTreeSearch<Reward>::merge_tree(NodePool& dst, NodeId dst_id, const NodePool& src, NodeId src_id) {
+    dst.add_stats(dst_id, src[src_id].visits, src[src_id].reward);
+
+    for (int k = 0; k < src[src_id].children_num; ++k) {
+        NodeId src_child = src.children_of(src_id).child[k];
+        NodeId dst_child = INVALID_NODE;
+        for (int j = 0; j < dst[dst_id].children_num; ++j) {
+            if (dst.children_of(dst_id).action[j] == src[src_child].action) {
+                dst_child = dst.children_of(dst_id).child[j];
+                break;
+            }
+        }
+        if (dst_child == INVALID_NODE) {
+            dst_child = dst.copy_node(src[src_child], dst_id);
+        }
+        merge_tree(dst, dst_child, src, src_child);
     }
-    StateList other_states = other_predict_traj[node->cur_level + 1];
-    node->add_child(next_action, dt, other_states);
+}
 
-    return node->children.back();
+template <typename Reward>
+void BasicMonteCarloTreeSearch<Reward>::apply_virtual_loss(NodePool& pool, NodeId node, bool revert) {
+    // a pending rollout counts as a visit with a bad result until it is backed up
+    int visits = revert ? -1 : 1;
+    double loss = revert ? -virtual_loss : virtual_loss;
+    while (node != INVALID_NODE) {
+        pool.add_stats(node, visits, -loss);
+        node = pool[node].parent;
+    }
 }
 
-std::shared_ptr<Node> MonteCarloTreeSearch::get_best_child(std::shared_ptr<Node> node, double scalar) {
-    double best_score = -INFINITY;
-    std::vector<std::shared_ptr<Node>> best_children;
+template <typename Reward>
+NodeId BasicMonteCarloTreeSearch<Reward>::tree_policy(NodePool& pool, NodeId node) {
+    while (pool[node].is_terminal() == false) {
+        const Node& cur_node = pool[node];
+        if (cur_node.children_num == 0) {
+            return expand(pool, node);
+        }
+        // widening adds a child once the visits allow one more, otherwise a coin decides
+        bool widen = widening_coeff > 0 ? cur_node.children_num < widening_limit(cur_node.visits)
+                                        : Random::uniform(0.0, 1.0) >= 0.5;
+        if (widen && cur_node.is_fully_expanded() == false) {
+            return expand(pool, node);
+        }
+        node = get_best_child(pool, node, MonteCarloTreeSearchBase::EXPLORATE_RATE);
+    }
+
+    return node;
+}
 
-    for (auto child : node->children) {
-        double exploit = child->reward / child->visits;
-        double explore = sqrt(2 * log(node->visits) / child->visits);
-        double score = exploit + scalar + explore;
-        if (score == best_score) {
-            best_children.push_back(child);
-        } else if (score > best_score) {
-            best_children = {child};
-            best_score = score;
+template <typename Reward>
+NodeId BasicMonteCarloTreeSearch<Reward>::expand(NodePool& pool, NodeId node) {
+    // one draw among the untried actions, in ACTION_LIST order
+    std::array<bool, ACTION_NUM> tried = {};
+    for (int k = 0; k < pool[node].children_num; ++k) {
+        tried[static_cast<size_t>(pool.children_of(node).action[k])] = true;
+    }
+    int untried_num = static_cast<int>(ACTION_NUM) - pool[node].children_num;
+    if (untried_num <= 0) {
+        return node;
+    }
+    int pick = Random::uniform(0, untried_num - 1);
+    size_t lane = 0;
+    for (; lane < ACTION_NUM; ++lane) {
+        if (!tried[lane] && pick-- == 0) {
+            break;
         }
     }
-    if (best_children.empty()) {
+    Action next_action = static_cast<Action>(lane);
+
+    // the child starts from the rotation of the parent, only a turn takes new trigonometry
+    State child_state = pool[node].state;
+    double cos_yaw = pool[node].cos_yaw;
+    double sin_yaw = pool[node].sin_yaw;
+    StateBatch step{&child_state.x, &child_state.y, &child_state.yaw, &child_state.v, &cos_yaw, &sin_yaw, 1};
+    utils::propagate_batch(step, &next_action, dt);
+    NodeId child = pool.add_child(node, next_action, child_state, cos_yaw, sin_yaw);
+    Node& child_node = pool[child];
+    // a child reaching a state another path got to first takes the reward of that state
+    const Transposition* transposition = pool.find_transposition(child);
+    double reward = transposition != nullptr ? transposition->reward :
+                    reward_func(child_node.state, cos_yaw, sin_yaw,
+                                child_node.goal_pose, *child_node.predictions, child_node.cur_level);
+    child_node.value = pool[node].value + MonteCarloTreeSearchBase::discount(child_node.cur_level - 1) * reward;
+    pool.transpose(child, reward);
+
+    return child;
+}
+
+template <typename Reward>
+NodeId BasicMonteCarloTreeSearch<Reward>::get_best_child(const NodePool& pool, NodeId node, double scalar) {
+    int children_num = pool[node].children_num;
+    if (children_num == 0) {
         return node;
     }
 
-    return Random::choice(best_children);
+    // all slots are scored so the loop has a fixed length, only the used ones are read back
+    const ChildBlock& block = pool.children_of(node);
+    double two_log_visits = 2 * log(pool[node].visits);
+    std::array<double, ACTION_NUM> scores;
+    for (size_t k = 0; k < ACTION_NUM; ++k) {
+        double visits = block.visits[k];
+        scores[k] = block.reward[k] / visits + scalar + sqrt(two_log_visits / visits);
+    }
+    // a merged child scores with the statistics of its state
+    for (int k = 0; k < children_num; ++k) {
+        if (block.transposition[k] != NO_TRANSPOSITION) {
+            const Transposition& shared = pool.transposition_of(block.transposition[k]);
+            double visits = shared.visits;
+            double reward = shared.visits * pool[block.child[k]].value + shared.future;
+            scores[k] = reward / visits + scalar + sqrt(two_log_visits / visits);
+        }
+    }
+
+    double best_score = -INFINITY;
+    std::array<NodeId, ACTION_NUM> best_children;
+    int best_num = 0;
+    for (int k = 0; k < children_num; ++k) {
+        if (scores[k] == best_score) {
+            best_children[best_num++] = block.child[k];
+        } else if (scores[k] > best_score) {
+            best_children[0] = block.child[k];
+            best_num = 1;
+            best_score = scores[k];
+        }
+    }
+    if (best_num == 0) {
+        return node;
+    }
+
+    return best_children[Random::uniform(0, best_num - 1)];
 }
 
-double MonteCarloTreeSearch::default_policy(std::shared_ptr<Node> node) {
-    while (!node->is_terminal()) {
-        StateList other_states= other_predict_traj[node->cur_level + 1];
-        std::shared_ptr<Node> next_node = node->next_node(dt, other_states);
-        node = next_node;
+template <typename Reward>
+double BasicMonteCarloTreeSearch<Reward>::default_policy(const Node& node) {
+    // Same draws and arithmetic as stepping with child nodes, without building any.
+    // Lane k of the batch is rollout k, every level draws the actions in lane order.
+    constexpr int LANES = SearchParams::MAX_LEAF_ROLLOUTS;
+    std::array<double, LANES> x, y, yaw, v, cos_yaw, sin_yaw, value;
+    std::array<Action, LANES> actions;
+    size_t lanes = static_cast<size_t>(leaf_rollouts);
+    for (size_t k = 0; k < lanes; ++k) {
+        x[k] = node.state.x;
+        y[k] = node.state.y;
+        yaw[k] = node.state.yaw;
+        v[k] = node.state.v;
+        cos_yaw[k] = node.cos_yaw;
+        sin_yaw[k] = node.sin_yaw;
+        value[k] = node.value;
+    }
+    StateBatch rollout{x.data(), y.data(), yaw.data(), v.data(), cos_yaw.data(), sin_yaw.data(), lanes};
+    for (int level = node.cur_level; level < Node::MAX_LEVEL; ++level) {
+        for (size_t k = 0; k < lanes; ++k) {
+            actions[k] = Random::choice(ACTION_LIST);
+        }
+        utils::propagate_batch(rollout, actions.data(), dt);
+        double discount = MonteCarloTreeSearchBase::discount(level);
+        for (size_t k = 0; k < lanes; ++k) {
+            value[k] = value[k] + discount * reward_func(State(x[k], y[k], yaw[k], v[k]), cos_yaw[k], sin_yaw[k],
+                                                         node.goal_pose, *node.predictions, level + 1);
+        }
     }
 
-    return node->value;
+    double value_sum = 0.0;
+    for (size_t k = 0; k < lanes; ++k) {
+        value_sum += value[k];
+    }
+
+    return value_sum;
+}
+
+template <typename Reward>
+void BasicMonteCarloTreeSearch<Reward>::update(NodePool& pool, NodeId node, int visits, double r) {
+    while (node != INVALID_NODE) {
+        pool.add_stats(node, visits, r);
+        node = pool[node].parent;
+    }
+}
+
+template struct WeightedReward<ConfigWeights>;
+template struct WeightedReward<ShippedWeights>;
+template class BasicMonteCarloTreeSearch<ConfigReward>;
+template class BasicMonteCarloTreeSearch<WeightedReward<ShippedWeights>>;
+
+SearchParams SearchParams::from_yaml(const YAML::Node& cfg) {
+    SearchParams params;
+    params.computation_budget = cfg["computation_budget"].as<uint64_t>();
+    params.dt = cfg["delta_t"].as<double>();
+    params.search_threads = cfg["search_threads"] ? std::max(cfg["search_threads"].as<int>(), 1) : 1;
+    params.virtual_loss = cfg["virtual_loss"] ? cfg["virtual_loss"].as<double>() : 1.0;
+    params.reuse_decay = cfg["reuse_decay"] ? cfg["reuse_decay"].as<double>() : 1.0;
+    params.widening_coeff = cfg["widening_coeff"] ? cfg["widening_coeff"].as<double>() : 0.0;
+    params.widening_exponent = cfg["widening_exponent"] ? cfg["widening_exponent"].as<double>() : 0.5;
+    params.leaf_rollouts = cfg["leaf_rollouts"] ?
+        std::clamp(cfg["leaf_rollouts"].as<int>(), 1, SearchParams::MAX_LEAF_ROLLOUTS) : 1;
+    params.transposition_resolution =
+        cfg["transposition_resolution"] ? cfg["transposition_resolution"].as<double>() : 0.0;
+    params.transposition_yaw_resolution =
+        cfg["transposition_yaw_resolution"] ? cfg["transposition_yaw_resolution"].as<double>() : 0.05;
+    params.parallel_mode = ParallelMode::ROOT;
+    if (cfg["search_parallel"]) {
+        std::string mode = cfg["search_parallel"].as<std::string>();
+        if (mode == "tree") {
+            params.parallel_mode = ParallelMode::TREE;
+        } else if (mode != "root") {
+            spdlog::error("search_parallel must be root or tree, fall back to root !");
+        }
+    }
+
+    return params;
 }
 
-void MonteCarloTreeSearch::update(std::shared_ptr<Node> node, double r) {
-    while (node != nullptr) {
-        node->visits += 1;
-        node->reward += r;
-        node = node->parent;
+PlannerParams PlannerParams::from_yaml(const YAML::Node& cfg) {
+    PlannerParams params;
+    params.steps = cfg["max_step"].as<int>();
+    params.dt = cfg["delta_t"].as<double>();
+    params.planning_deadline_ms = cfg["planning_deadline_ms"] ? cfg["planning_deadline_ms"].as<double>() : 0.0;
+    params.tree_reuse = cfg["tree_reuse"] ? cfg["tree_reuse"].as<bool>() : false;
+    params.reuse_budget_ratio = cfg["reuse_budget_ratio"] ? cfg["reuse_budget_ratio"].as<double>() : 0.3;
+    params.reuse_tolerance = cfg["reuse_tolerance"] ? cfg["reuse_tolerance"].as<double>() : 0.05;
+    params.search = SearchParams::from_yaml(cfg);
+
+    return params;
+}
+
+std::unique_ptr<MonteCarloTreeSearch> PlanningContext::acquire_search(void) {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (!idle_searches.empty()) {
+            std::unique_ptr<MonteCarloTreeSearch> search = std::move(idle_searches.back());
+            idle_searches.pop_back();
+            return search;
+        }
+        ++searches_num;
     }
+
+    // built outside the lock, reserving the node pool is the expensive part
+    return std::make_unique<MonteCarloTreeSearch>(params.search);
+}
+
+void PlanningContext::release_search(std::unique_ptr<MonteCarloTreeSearch> search) {
+    std::lock_guard<std::mutex> lock(mutex);
+    idle_searches.emplace_back(std::move(search));
+}
+
+size_t PlanningContext::searches_created(void) {
+    std::lock_guard<std::mutex> lock(mutex);
+    return searches_num;
+}
+
+size_t PlanningContext::reserved_bytes(void) {
+    std::lock_guard<std::mutex> lock(mutex);
+    size_t bytes = 0;
+    for (const std::unique_ptr<MonteCarloTreeSearch>& search : idle_searches) {
+        bytes += search->reserved_bytes();
+    }
+
+    return bytes;
+}
+
+size_t PredictionKeyHash::operator()(const PredictionKey& key) const {
+    size_t seed = key.name_hash;
+    utils::hash_combine(seed, key.level);
+    utils::hash_combine(seed, key.state_hash);
+
+    return seed;
+}
+
+StateList PredictionCache::get_or_compute(const PredictionKey& key, const std::function<StateList(void)>& compute) {
+    std::promise<StateList> promise;
+    std::shared_future<StateList> pending;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto iter = entries.find(key);
+        if (iter != entries.end()) {
+            ++hits;
+            pending = iter->second;
+        } else {
+            ++misses;
+            entries.emplace(key, promise.get_future().share());
+        }
+    }
+    if (pending.valid()) {
+        return pending.get();
+    }
+
+    try {
+        StateList result = compute();
+        promise.set_value(result);
+        return result;
+    } catch (...) {
+        promise.set_exception(std::current_exception());
+        throw;
+    }
+}
+
+void PredictionCache::clear(void) {
+    std::lock_guard<std::mutex> lock(mutex);
+    entries.clear();
+    hits = 0;
+    misses = 0;
+}
+
+uint64_t PredictionCache::hit_count(void) {
+    std::lock_guard<std::mutex> lock(mutex);
+    return hits;
 }
 
-std::pair<Action, StateList> KLevelPlanner::planning(
-            const VehicleBase& ego, const std::vector<VehicleBase>& others) {
-    std::vector<StateList> other_prediction = get_prediction(ego, others);
-    std::pair<std::vector<Action>, StateList> ret = forward_simulate(ego, others, other_prediction);
+uint64_t PredictionCache::miss_count(void) {
+    std::lock_guard<std::mutex> lock(mutex);
+    return misses;
+}
+
+std::pair<Action, StateList> KLevelPlanner::planning(const WorldSnapshot& world, int ego_id, uint64_t seed) {
+    step_seed = seed;
+    Random::Stream stream(Random::derive(seed, world.name_hash(ego_id)));
+    const State& ego_state = world.state(ego_id);
+    Deadline deadline = Deadline::max();
+    if (planning_deadline_ms > 0) {
+        deadline = std::chrono::steady_clock::now() + std::chrono::duration_cast<Deadline::duration>(
+            std::chrono::duration<double, std::milli>(planning_deadline_ms));
+    }
+    TraceEvent planning_event;
+    if (trace) {
+        owner = world.name(ego_id);
+        planning_event = trace->begin(TraceCategory::PLANNING, owner, owner, world.level(ego_id));
+    }
+    mcts.profile = ego_mcts.profile = static_cast<bool>(trace);
+
+    std::vector<StateList> other_prediction = get_prediction(world, ego_id, world.level(ego_id), deadline);
+    std::pair<std::vector<Action>, StateList> ret;
+    int64_t search_start = trace ? trace->now_us() : 0;
+    if (tree_reuse) {
+        NodeId root;
+        uint64_t budget = ego_mcts.computation_budget;
+        if (can_reuse(ego_state)) {
+            root = ego_mcts.reroot(reuse_node, other_prediction);
+            // a small ratio still runs one iteration, the root needs a child to act on
+            budget = std::max<uint64_t>(1, static_cast<uint64_t>(budget * reuse_budget_ratio));
+        } else {
+            ego_mcts.reset(other_prediction);
+            root = ego_mcts.tree.create(ego_state, 0, INVALID_NODE, Action::MAINTAIN, &ego_mcts.predictions,
+                                        world.target(ego_id));
+        }
+        ret = extract_path(ego_mcts, root, budget, deadline, &reuse_node);
+    } else {
+        ret = forward_simulate(mcts, ego_state, world.target(ego_id), other_prediction, deadline);
+    }
+    const MonteCarloTreeSearch& ego_search = tree_reuse ? ego_mcts : mcts;
+    iterations = ego_search.stats.iterations;
+    if (trace) {
+        record_search(owner, world.level(ego_id), ego_search, search_start);
+        planning_event.stats = ego_search.stats;
+        trace->end(planning_event);
+    }
+
+    // no iteration ran, for a zero budget or a deadline already past
+    if (ret.first.empty()) {
+        spdlog::warn(fmt::format("{} searched no action, fall back to MAINTAIN", world.name(ego_id)));
+        return std::make_pair(Action::MAINTAIN, ret.second);
+    }
 
     return std::make_pair(ret.first[0], ret.second);
 }
 
+void KLevelPlanner::record_search(
+    const std::string& subject, int level, const MonteCarloTreeSearch& search, int64_t start_us) {
+    TraceEvent event = trace->begin(TraceCategory::SEARCH, owner, subject, level);
+    event.start_us = start_us;
+    event.stats = search.stats;
+    trace->end(event);
+}
+
+bool KLevelPlanner::can_reuse(const State& state) {
+    if (reuse_node == INVALID_NODE) {
+        return false;
+    }
+
+    const State& expected = ego_mcts.tree[reuse_node].state;
+    double delta_yaw = std::fmod(abs(state.yaw - expected.yaw), TWO_PI);
+    delta_yaw = std::min(delta_yaw, TWO_PI - delta_yaw);
+
+    return abs(state.x - expected.x) < reuse_tolerance && abs(state.y - expected.y) < reuse_tolerance &&
+           abs(state.v - expected.v) < reuse_tolerance && delta_yaw < reuse_tolerance;
+}
+
 std::pair<std::vector<Action>, StateList> KLevelPlanner::forward_simulate(
-    const VehicleBase& ego, const std::vector<VehicleBase>& others, const std::vector<StateList>& traj) {
-    MonteCarloTreeSearch mcts(ego, others, traj, config);
-    std::shared_ptr<Node> current_node =
-        std::make_shared<Node>(ego.state, 0, nullptr, Action::MAINTAIN, StateList(), ego.target);
-    current_node = mcts.excute(current_node);
+    const VehicleBase& ego, const std::vector<StateList>& traj) {
+    return forward_simulate(mcts, ego.state, ego.target, traj, Deadline::max());
+}
+
+std::pair<std::vector<Action>, StateList> KLevelPlanner::forward_simulate(MonteCarloTreeSearch& search,
+    const State& state, const State& target, const std::vector<StateList>& traj, Deadline deadline) {
+    search.reset(traj);
+    NodeId root = search.tree.create(state, 0, INVALID_NODE, Action::MAINTAIN, &search.predictions, target);
+
+    return extract_path(search, root, search.computation_budget, deadline);
+}
+
+std::pair<std::vector<Action>, StateList> KLevelPlanner::extract_path(MonteCarloTreeSearch& search, NodeId root,
+    uint64_t budget, Deadline deadline, NodeId* first_node) {
+    NodeId current_node = search.excute(root, budget, deadline);
+    if (first_node != nullptr) {
+        *first_node = current_node != root ? current_node : INVALID_NODE;
+    }
     for (int i = 0; i < Node::MAX_LEVEL - 1; ++i) {
-        current_node = mcts.get_best_child(current_node, 0);
+        current_node = search.get_best_child(current_node, 0);
     }
 
-    std::vector<Action> actions = current_node->actions;
+    std::vector<Action> actions;
     StateList expected_traj;
-    while (current_node != nullptr) {
-        expected_traj.push_back(current_node->state);
-        current_node = current_node->parent;
+    expected_traj.reserve(steps + 1);
+    while (current_node != INVALID_NODE) {
+        const Node& node = search.tree[current_node];
+        expected_traj.push_back(node.state);
+        if (node.parent != INVALID_NODE) {
+            actions.push_back(node.action);
+        }
+        current_node = node.parent;
     }
     expected_traj.reverse();
+    std::reverse(actions.begin(), actions.end());
 
-    if (expected_traj.size() < steps + 1) {
+    if (expected_traj.size() < static_cast<size_t>(steps) + 1) {
         spdlog::debug(fmt::format(
             "The max level of the node is not enough({}),using the last value to complete it.",
             expected_traj.size()));
@@ -225,54 +843,137 @@ std::pair<std::vector<Action>, StateList> KLevelPlanner::forward_simulate(
     return std::make_pair(actions, expected_traj);
 }
 
+// Searches a level-k prediction runs, its own one plus those of the others below it.
+static double searches_per_prediction(int level, size_t others_num) {
+    double searches = 1.0;
+    for (int idx = 0; idx < level; ++idx) {
+        searches = 1.0 + others_num * searches;
+    }
+
+    return searches;
+}
+
 std::vector<StateList> KLevelPlanner::get_prediction(
-    const VehicleBase& ego, const std::vector<VehicleBase>& others) {
+    const WorldSnapshot& world, int ego_id, int level, Deadline deadline) {
     std::vector<StateList> pred_trajectory;
     std::vector<StateList> pred_trajectory_trans;
+    int agents_num = static_cast<int>(world.size());
+    size_t others_num = world.size() - 1;
 
-    if (ego.level == 0) {
-        for (size_t i = 0; i < steps + 1; ++i) {
+    if (level == 0) {
+        for (size_t i = 0; i < static_cast<size_t>(steps) + 1; ++i) {
             StateList pred_traj;
-            for (const VehicleBase& other : others) {
-                pred_traj.push_back(other.state);
+            pred_traj.reserve(others_num);
+            for (int id = 0; id < agents_num; ++id) {
+                if (id != ego_id) {
+                    pred_traj.push_back(world.state(id));
+                }
             }
-            pred_trajectory.emplace_back(pred_traj);
+            pred_trajectory.emplace_back(std::move(pred_traj));
         }
         return pred_trajectory;
-    } else if (ego.level > 0) {
-        for (size_t idx = 0; idx < others.size(); ++idx) {
-            if (others[idx].is_get_target()) {
+    } else if (level > 0) {
+        pred_trajectory_trans.resize(others_num);
+        // every search below gets the same share of the time left, the ego search keeps one
+        size_t predicted_num = 0;
+        for (int id = 0; id < agents_num; ++id) {
+            predicted_num += id != ego_id && !world.is_get_target(id) ? 1 : 0;
+        }
+        Deadline predictions_deadline = deadline;
+        if (deadline != Deadline::max() && predicted_num > 0) {
+            double below = predicted_num * searches_per_prediction(level - 1, others_num);
+            auto now = std::chrono::steady_clock::now();
+            auto left = std::max(deadline - now, Deadline::duration::zero());
+            predictions_deadline = now + std::chrono::duration_cast<Deadline::duration>(left * (below / (below + 1)));
+        }
+        std::vector<std::pair<size_t, std::future<StateList>>> jobs;
+        for (int id = 0; id < agents_num; ++id) {
+            if (id == ego_id) {
+                continue;
+            }
+            size_t idx = id < ego_id ? id : id - 1;
+            if (world.is_get_target(id)) {
                 StateList pred_traj;
-                for (size_t i = 0; i < steps + 1; ++i) {
-                    pred_traj.push_back(others[idx].state);
-                }
-                pred_trajectory_trans.emplace_back(pred_traj);
+                pred_traj.expand(steps + 1, world.state(id));
+                pred_trajectory_trans[idx] = std::move(pred_traj);
                 continue;
             }
-            VehicleBase exchanged_ego = others[idx];
-            exchanged_ego.level = ego.level - 1;
-            std::vector<VehicleBase> exchanged_others = {ego};
-            for (size_t i = 0; i < others.size(); ++i) {
-                if (i != idx) {
-                    exchanged_others.push_back(others[i]);
+            if (thread_pool) {
+                jobs.emplace_back(idx, thread_pool->submit([this, &world, level, id, predictions_deadline]() {
+                    return predict_other(world, level, id, predictions_deadline);
+                }));
+            } else {
+                // in order, each one splits what the earlier ones left over
+                Deadline other_deadline = predictions_deadline;
+                if (predictions_deadline != Deadline::max()) {
+                    auto now = std::chrono::steady_clock::now();
+                    auto left = std::max(predictions_deadline - now, Deadline::duration::zero());
+                    other_deadline = now + left / predicted_num;
                 }
+                --predicted_num;
+                pred_trajectory_trans[idx] = predict_other(world, level, id, other_deadline);
             }
-            std::vector<StateList> exchage_pred_others = get_prediction(exchanged_ego, exchanged_others);
-            auto pred_idx_vechicle = forward_simulate(exchanged_ego, exchanged_others, exchage_pred_others);
-            pred_trajectory_trans.emplace_back(pred_idx_vechicle.second);
+        }
+        for (auto& job : jobs) {
+            pred_trajectory_trans[job.first] = thread_pool->wait(job.second);
         }
     } else {
         spdlog::error("get_prediction() excute error, the level must be >= 0 and > 3 !");
         return pred_trajectory;
     }
 
+    pred_trajectory.reserve(steps + 1);
     for (int idx = 0; idx < steps + 1; ++idx) {
         StateList state;
+        state.reserve(pred_trajectory_trans.size());
         for (const StateList& states : pred_trajectory_trans) {
             state.push_back(states[idx]);
         }
-        pred_trajectory.emplace_back(state);
+        pred_trajectory.emplace_back(std::move(state));
     }
 
     return pred_trajectory;
 }
+
+StateList KLevelPlanner::predict_other(const WorldSnapshot& world, int level, int other_id, Deadline deadline) {
+    // the other agent plans one level lower, against everyone else including the ego
+    int exchanged_level = level - 1;
+
+    TraceEvent prediction_event;
+    if (trace) {
+        prediction_event = trace->begin(TraceCategory::PREDICTION, owner, world.name(other_id), exchanged_level);
+    }
+
+    // predictions may run side by side, each one searches its own tree
+    PredictionKey key{world.name_hash(other_id), exchanged_level, world.hash_from(other_id)};
+    bool computed = false;
+    auto predict_exchanged_ego = [&]() {
+        computed = true;
+        Random::Stream stream(Random::derive(step_seed, key.name_hash, key.level, key.state_hash));
+        std::vector<StateList> exchage_pred_others = get_prediction(world, other_id, exchanged_level, deadline);
+        std::unique_ptr<MonteCarloTreeSearch> search = context->acquire_search();
+        search->profile = static_cast<bool>(trace);
+        search->thread_pool = thread_pool.get();
+        int64_t search_start = trace ? trace->now_us() : 0;
+        StateList predicted = forward_simulate(*search, world.state(other_id), world.target(other_id),
+                                               exchage_pred_others, deadline).second;
+        if (trace) {
+            record_search(world.name(other_id), exchanged_level, *search, search_start);
+        }
+        context->release_search(std::move(search));
+        return predicted;
+    };
+    StateList predicted;
+    if (prediction_cache) {
+        predicted = prediction_cache->get_or_compute(key, predict_exchanged_ego);
+    } else {
+        predicted = predict_exchanged_ego();
+    }
+
+    if (trace) {
+        prediction_event.cached = !computed;
+        trace->end(prediction_event);
+    }
+
+    return predicted;
+}
@@ -0,0 +1,161 @@
+#include <fmt/core.h>
+#include <spdlog/spdlog.h>
+#include <matplotlib-cpp/matplotlibcpp.h>
+
+#include "renderer.hpp"
+
+namespace plt = matplotlibcpp;
+
+// `coords` moved by `offset`
+static std::vector<double> shifted(const std::vector<double>& coords, double offset) {
+    std::vector<double> moved(coords);
+    for (double& coord : moved) {
+        coord += offset;
+    }
+
+    return moved;
+}
+
+void EnvCrossroads::draw_env(void)
+{
+    for (size_t idx = 0; idx < tiles.size(); ++idx) {
+        double x = tile_x(idx);
+        double y = tile_y(idx);
+        for (const std::vector<std::vector<double>>& r : tile.rect) {
+            plt::fill(shifted(r[0], x), shifted(r[1], y), {{"color", "#BFBFBF"}});
+            plt::plot(shifted(r[0], x), shifted(r[1], y), {{"color", "k"}, {"linewidth", "2"}});
+        }
+        for (const std::vector<std::vector<double>>& l : tile.laneline) {
+            plt::plot(shifted(l[0], x), shifted(l[1], y),
+                {{"color", "orange"}, {"linewidth", "2"}, {"linestyle", "--"}});
+        }
+    }
+}
+
+Frame Frame::capture(Kind kind, VehicleList& vehicles, int round, int rounds_num,
+                     const std::vector<std::vector<State>>& footprints) {
+    Frame frame;
+    frame.kind = kind;
+    frame.round = round;
+    frame.rounds_num = rounds_num;
+    for (size_t idx = 0; idx < vehicles.size(); ++idx) {
+        std::shared_ptr<Vehicle> vehicle = vehicles[idx];
+        VehicleFrame vehicle_frame;
+        vehicle_frame.name = vehicle->name;
+        vehicle_frame.color = vehicle->color;
+        vehicle_frame.level = vehicle->level;
+        vehicle_frame.state = vehicle->state;
+        vehicle_frame.target = vehicle->target;
+        vehicle_frame.text_pos = vehicle->vis_text_pos;
+        vehicle_frame.action = vehicle->cur_action;
+        if (kind == Kind::STEP) {
+            vehicle_frame.excepted_traj = vehicle->excepted_traj;
+        } else if (idx < footprints.size()) {
+            vehicle_frame.footprint = footprints[idx];
+        }
+        frame.vehicles.emplace_back(std::move(vehicle_frame));
+    }
+
+    return frame;
+}
+
+FrameRenderer::FrameRenderer(std::shared_ptr<EnvCrossroads> _env, bool _save_fig,
+                             std::filesystem::path _save_path, size_t _max_pending) :
+    env(_env), save_fig(_save_fig), save_path(_save_path),
+    max_pending(std::max<size_t>(_max_pending, 1)), stop(false), dropped(0) {
+    worker = std::thread(&FrameRenderer::render_loop, this);
+}
+
+FrameRenderer::~FrameRenderer() {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stop = true;
+    }
+    cond.notify_all();
+    worker.join();
+}
+
+void FrameRenderer::push(Frame&& frame) {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (frame.kind == Frame::Kind::STEP && frames.size() >= max_pending) {
+            for (auto iter = frames.begin(); iter != frames.end(); ++iter) {
+                if (iter->kind == Frame::Kind::STEP) {
+                    frames.erase(iter);
+                    ++dropped;
+                    break;
+                }
+            }
+        }
+        frames.emplace_back(std::move(frame));
+    }
+    cond.notify_one();
+}
+
+uint64_t FrameRenderer::dropped_count(void) {
+    std::lock_guard<std::mutex> lock(mutex);
+    return dropped;
+}
+
+void FrameRenderer::render_loop(void) {
+    while (true) {
+        Frame frame;
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            cond.wait(lock, [this]() { return stop || !frames.empty(); });
+            if (frames.empty()) {
+                return ;
+            }
+            frame = std::move(frames.front());
+            frames.pop_front();
+        }
+        if (frame.kind == Frame::Kind::STEP) {
+            draw_step(frame);
+        } else {
+            draw_summary(frame);
+        }
+    }
+}
+
+void FrameRenderer::draw_step(const Frame& frame) {
+    plt::cla();
+    env->draw_env();
+    for (const VehicleFrame& vehicle : frame.vehicles) {
+        auto excepted_traj = vehicle.excepted_traj.to_vector();
+        Vehicle::draw_vehicle(vehicle.state, vehicle.color);
+        plt::plot({vehicle.target.x}, {vehicle.target.y}, {{"marker", "x"}, {"color", vehicle.color}});
+        plt::plot(excepted_traj[0], excepted_traj[1], {{"color", vehicle.color}, {"linewidth", "1"}});
+        plt::text(vehicle.text_pos.x, vehicle.text_pos.y + 3,
+                    fmt::format("level {:d}", vehicle.level), {{"color", vehicle.color}});
+        plt::text(vehicle.text_pos.x, vehicle.text_pos.y,
+                    fmt::format("v = {:.2f} m/s", vehicle.state.v), {{"color", vehicle.color}});
+        plt::text(vehicle.text_pos.x, vehicle.text_pos.y - 3,
+                    fmt::format("{}", utils::get_action_name(vehicle.action)), {{"color", vehicle.color}});
+    }
+    plt::xlim(env->min_x(), env->max_x());
+    plt::ylim(env->min_y(), env->max_y());
+    plt::title(fmt::format("Round {} / {}", frame.round + 1, frame.rounds_num));
+    plt::set_aspect_equal();
+    plt::pause(0.01);
+}
+
+void FrameRenderer::draw_summary(const Frame& frame) {
+    plt::clf();
+    env->draw_env();
+
+    for (const VehicleFrame& vehicle : frame.vehicles) {
+        for (const State& state : vehicle.footprint) {
+            Vehicle::draw_vehicle(state, vehicle.color, true);
+        }
+        plt::text(vehicle.text_pos.x, vehicle.text_pos.y + 3,
+                    fmt::format("level {:d}", vehicle.level), {{"color", vehicle.color}});
+    }
+    plt::xlim(env->min_x(), env->max_x());
+    plt::ylim(env->min_y(), env->max_y());
+    plt::title(fmt::format("Round {} / {}", frame.round + 1, frame.rounds_num));
+    plt::set_aspect_equal();
+    plt::pause(1);
+    if (save_fig) {
+        plt::save((save_path / ("Round_" + std::to_string(frame.round) + ".svg")).string(), 600);
+    }
+}
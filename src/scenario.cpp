@@ -0,0 +1,172 @@
+#include <cmath>
+#include <string>
+#include <numeric>
+#include <algorithm>
+#include <fmt/core.h>
+#include <spdlog/spdlog.h>
+
+#include "utils.hpp"
+#include "scenario.hpp"
+
+static const std::vector<std::string> SCENARIO_COLORS =
+    {"blue", "red", "green", "orange", "purple", "brown", "magenta", "gray", "olive", "cyan"};
+
+// yaw and unit direction of every heading, quarter turns counterclockwise from +x
+static const double HEADING_YAW[4] = {0.0, M_PI_2, M_PI, -M_PI_2};
+static const int HEADING_X[4] = {1, 0, -1, 0};
+static const int HEADING_Y[4] = {0, 1, 0, -1};
+
+// centers of the first queued vehicle and the spacing of the queue on an approach
+static constexpr double QUEUE_START = 12.0;
+static constexpr double QUEUE_SPACING = 9.0;
+// along the lane a vehicle starts anywhere in [slot, slot + QUEUE_JITTER]
+static constexpr double QUEUE_JITTER = 4.0;
+// the outermost target of an exit sits this far inside the map edge, the
+// vehicles that leave later stop QUEUE_SPACING short of the one before them
+// and never closer than TARGET_MIN to the center
+static constexpr double TARGET_MARGIN = 7.0;
+static constexpr double TARGET_MIN = 10.0;
+
+template <typename T>
+static void shuffle(std::vector<T>& items) {
+    for (int idx = static_cast<int>(items.size()) - 1; idx > 0; --idx) {
+        std::swap(items[idx], items[Random::uniform(0, idx)]);
+    }
+}
+
+// levels of `vehicles_num` vehicles after the weights of `mix`, by largest remainder
+static std::vector<int> split_levels(int vehicles_num, const std::vector<double>& mix) {
+    std::vector<double> weights = mix;
+    weights.resize(3, 0.0);
+    for (double& weight : weights) {
+        weight = std::max(weight, 0.0);
+    }
+    double total = std::accumulate(weights.begin(), weights.end(), 0.0);
+    if (total <= 0) {
+        spdlog::error("scenario level mix has no positive weight, fall back to level 1 !");
+        weights = {0.0, 1.0, 0.0};
+        total = 1.0;
+    }
+
+    std::vector<int> counts(weights.size());
+    std::vector<std::pair<double, int>> remainders;
+    int assigned = 0;
+    for (size_t level = 0; level < weights.size(); ++level) {
+        double share = vehicles_num * weights[level] / total;
+        counts[level] = static_cast<int>(std::floor(share));
+        assigned += counts[level];
+        remainders.emplace_back(share - counts[level], static_cast<int>(level));
+    }
+    std::stable_sort(remainders.begin(), remainders.end(),
+                     [](const std::pair<double, int>& a, const std::pair<double, int>& b) { return a.first > b.first; });
+    for (int idx = 0; assigned < vehicles_num; ++idx, ++assigned) {
+        ++counts[remainders[idx % remainders.size()].second];
+    }
+
+    std::vector<int> levels;
+    for (size_t level = 0; level < counts.size(); ++level) {
+        levels.insert(levels.end(), counts[level], static_cast<int>(level));
+    }
+
+    return levels;
+}
+
+YAML::Node generate_scenario(const YAML::Node& base, const ScenarioSpec& spec) {
+    YAML::Node config = YAML::Clone(base);
+    int vehicles_num = std::max(spec.vehicles_num, 1);
+    double lane_width = base["lane_width"].as<double>();
+    int queue_len = (vehicles_num + 3) / 4;
+    double queue_end = QUEUE_START + QUEUE_SPACING * (queue_len - 1) + QUEUE_JITTER;
+    double exit_len = TARGET_MARGIN + TARGET_MIN + QUEUE_SPACING * (queue_len - 1);
+    double map_size = std::max({base["map_size"].as<double>(), queue_end + QUEUE_SPACING / 2 + 1.0, exit_len});
+    config["map_size"] = map_size;
+
+    Random::Stream stream(Random::derive(spec.seed, static_cast<uint64_t>(vehicles_num)));
+    // a vehicle of heading k enters opposite to it, on the right hand lane
+    std::vector<int> headings(vehicles_num);
+    for (int idx = 0; idx < vehicles_num; ++idx) {
+        headings[idx] = idx % 4;
+    }
+    shuffle(headings);
+    std::vector<int> levels = split_levels(vehicles_num, spec.level_mix);
+    shuffle(levels);
+
+    std::vector<int> queue_pos(vehicles_num);
+    std::vector<int> queued(4, 0);
+    for (int idx = 0; idx < vehicles_num; ++idx) {
+        queue_pos[idx] = queued[headings[idx]]++;
+    }
+    // the front of every queue picks its exit first, each vehicle takes the least
+    // used one of straight, left and right
+    std::vector<int> order(vehicles_num);
+    std::iota(order.begin(), order.end(), 0);
+    std::stable_sort(order.begin(), order.end(), [&queue_pos](int a, int b) { return queue_pos[a] < queue_pos[b]; });
+    std::vector<int> exit_headings(vehicles_num);
+    std::vector<int> leaving(4, 0);
+    for (int idx : order) {
+        int heading = headings[idx];
+        std::vector<int> exits = {heading, (heading + 1) % 4, (heading + 3) % 4};
+        int fewest = std::min({leaving[exits[0]], leaving[exits[1]], leaving[exits[2]]});
+        exits.erase(std::remove_if(exits.begin(), exits.end(),
+                                   [&leaving, fewest](int exit) { return leaving[exit] > fewest; }), exits.end());
+        exit_headings[idx] = Random::choice(exits);
+        ++leaving[exit_headings[idx]];
+    }
+    // A vehicle parks on its target, so the vehicles of one exit stop one behind the
+    // other and the first to arrive goes farthest out. Arrival is guessed from the
+    // way to the exit: the queue slot plus the turn across the junction.
+    auto arrival = [&](int idx) {
+        int turn = (exit_headings[idx] - headings[idx] + 4) % 4;
+        double crossing = turn == 0 ? 4.0 : (turn == 1 ? 3.9 : 2.4);
+        return QUEUE_SPACING * queue_pos[idx] + crossing * lane_width;
+    };
+    std::stable_sort(order.begin(), order.end(), [&arrival](int a, int b) { return arrival(a) < arrival(b); });
+    std::vector<int> exit_rank(vehicles_num);
+    std::fill(leaving.begin(), leaving.end(), 0);
+    for (int idx : order) {
+        exit_rank[idx] = leaving[exit_headings[idx]]++;
+    }
+
+    YAML::Node vehicle_list;
+    for (int idx = 0; idx < vehicles_num; ++idx) {
+        int heading = headings[idx];
+        int exit_heading = exit_headings[idx];
+        double slot = QUEUE_START + QUEUE_SPACING * queue_pos[idx];
+
+        double dir_x = HEADING_X[heading];
+        double dir_y = HEADING_Y[heading];
+        // the right hand lane is half a lane to the right of the center line
+        double lane_x = dir_y * lane_width / 2;
+        double lane_y = -dir_x * lane_width / 2;
+        double near_x = lane_x - dir_x * slot;
+        double far_x = lane_x - dir_x * (slot + QUEUE_JITTER);
+        double near_y = lane_y - dir_y * slot;
+        double far_y = lane_y - dir_y * (slot + QUEUE_JITTER);
+
+        double exit_x = HEADING_X[exit_heading];
+        double exit_y = HEADING_Y[exit_heading];
+        double target_distance = std::max(map_size - TARGET_MARGIN - QUEUE_SPACING * exit_rank[idx], TARGET_MIN);
+
+        YAML::Node vehicle;
+        vehicle["level"] = levels[idx];
+        vehicle["color"] = SCENARIO_COLORS[idx % SCENARIO_COLORS.size()];
+        vehicle["init"]["x"]["min"] = std::min(near_x, far_x);
+        vehicle["init"]["x"]["max"] = std::max(near_x, far_x);
+        vehicle["init"]["y"]["min"] = std::min(near_y, far_y);
+        vehicle["init"]["y"]["max"] = std::max(near_y, far_y);
+        vehicle["init"]["yaw"] = HEADING_YAW[heading];
+        vehicle["init"]["v"]["min"] = 3.0;
+        vehicle["init"]["v"]["max"] = 5.0;
+        vehicle["target"]["x"] = exit_x * target_distance + exit_y * lane_width / 2;
+        vehicle["target"]["y"] = exit_y * target_distance - exit_x * lane_width / 2;
+        vehicle["target"]["yaw"] = HEADING_YAW[exit_heading];
+        // the labels stack up in the corners of the map
+        int corner = idx % 4;
+        vehicle["text"]["x"] = (corner % 2 == 0 ? 1 : -1) * (2 * lane_width + 2);
+        vehicle["text"]["y"] = (corner < 2 ? -1 : 1) * (map_size - 4 - 9 * (idx / 4));
+        vehicle_list[fmt::format("vehilce_{}", idx)] = vehicle;
+    }
+    config["vehicle_list"] = vehicle_list;
+
+    return config;
+}
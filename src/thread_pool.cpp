@@ -0,0 +1,106 @@
+#include <algorithm>
+
+#include "thread_pool.hpp"
+
+thread_local ThreadPool* ThreadPool::current_pool = nullptr;
+thread_local int ThreadPool::current_worker = -1;
+thread_local uint64_t ThreadPool::current_task_begin = 0;
+
+ThreadPool::ThreadPool(int threads_num) :
+    workers_num(std::max(threads_num, 1)), stop(false), pending(0), task_index(0) {
+    for (int idx = 0; idx < workers_num + 1; ++idx) {
+        queues.emplace_back(std::make_unique<WorkQueue>());
+    }
+    for (int idx = 0; idx < workers_num; ++idx) {
+        workers.emplace_back(&ThreadPool::worker_loop, this, idx);
+    }
+}
+
+ThreadPool::~ThreadPool() {
+    {
+        std::lock_guard<std::mutex> lock(wake_mutex);
+        stop = true;
+    }
+    wake_cond.notify_all();
+    for (std::thread& worker : workers) {
+        worker.join();
+    }
+}
+
+void ThreadPool::push(std::function<void(void)> func) {
+    int queue_idx = is_worker() ? current_worker : workers_num;
+    {
+        std::lock_guard<std::mutex> lock(queues[queue_idx]->mutex);
+        queues[queue_idx]->tasks.push_back(Task{task_index.fetch_add(1), std::move(func)});
+    }
+    {
+        std::lock_guard<std::mutex> lock(wake_mutex);
+        ++pending;
+    }
+    wake_cond.notify_one();
+}
+
+bool ThreadPool::pop_back(int queue_idx, uint64_t min_index, Task& task) {
+    WorkQueue& queue = *queues[queue_idx];
+    std::lock_guard<std::mutex> lock(queue.mutex);
+    if (queue.tasks.empty() || queue.tasks.back().index < min_index) {
+        return false;
+    }
+    task = std::move(queue.tasks.back());
+    queue.tasks.pop_back();
+    --pending;
+
+    return true;
+}
+
+bool ThreadPool::pop_front(int queue_idx, Task& task) {
+    WorkQueue& queue = *queues[queue_idx];
+    std::lock_guard<std::mutex> lock(queue.mutex);
+    if (queue.tasks.empty()) {
+        return false;
+    }
+    task = std::move(queue.tasks.front());
+    queue.tasks.pop_front();
+    --pending;
+
+    return true;
+}
+
+bool ThreadPool::find_task(int worker_idx, Task& task) {
+    // own queue newest first, then the shared queue, then steal the oldest
+    if (pop_back(worker_idx, 0, task) || pop_front(workers_num, task)) {
+        return true;
+    }
+    for (int offset = 1; offset < workers_num; ++offset) {
+        if (pop_front((worker_idx + offset) % workers_num, task)) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+void ThreadPool::run_task(Task& task) {
+    // tasks pushed from now on descend from this one
+    uint64_t parent_begin = current_task_begin;
+    current_task_begin = task_index.load();
+    task.func();
+    current_task_begin = parent_begin;
+}
+
+void ThreadPool::worker_loop(int worker_idx) {
+    current_pool = this;
+    current_worker = worker_idx;
+    while (true) {
+        Task task;
+        if (find_task(worker_idx, task)) {
+            run_task(task);
+            continue;
+        }
+        std::unique_lock<std::mutex> lock(wake_mutex);
+        wake_cond.wait(lock, [this]() { return stop || pending > 0; });
+        if (stop && pending == 0) {
+            return ;
+        }
+    }
+}
@@ -0,0 +1,155 @@
+#include <fstream>
+#include <algorithm>
+#include <spdlog/spdlog.h>
+#include <fmt/core.h>
+
+#include "trace.hpp"
+
+static const char* CATEGORY_NAMES[] = {"step", "planning", "prediction", "search"};
+
+// small ids in the order threads first record, the viewers sort lanes by them
+static int current_thread_id(void) {
+    static std::atomic<int> next_id(0);
+    thread_local int id = next_id.fetch_add(1);
+    return id;
+}
+
+static std::string event_name(const TraceEvent& event) {
+    switch (event.category) {
+    case TraceCategory::STEP:
+        return fmt::format("round {} step {}", event.round, event.step);
+    case TraceCategory::PLANNING:
+        return fmt::format("plan {} L{}", event.subject, event.level);
+    case TraceCategory::PREDICTION:
+        return fmt::format("predict {} L{}{}", event.subject, event.level, event.cached ? " (cached)" : "");
+    default:
+        return fmt::format("search {} L{}", event.subject, event.level);
+    }
+}
+
+SearchStats& SearchStats::operator+=(const SearchStats& other) {
+    iterations += other.iterations;
+    nodes_created += other.nodes_created;
+    nodes_merged += other.nodes_merged;
+    rollouts += other.rollouts;
+    reward_evaluations += other.reward_evaluations;
+    collision_checks += other.collision_checks;
+    max_depth = std::max(max_depth, other.max_depth);
+    max_width = std::max(max_width, other.max_width);
+    tree_policy_time += other.tree_policy_time;
+    default_policy_time += other.default_policy_time;
+    update_time += other.update_time;
+
+    return *this;
+}
+
+TraceEvent TraceRecorder::begin(
+    TraceCategory category, const std::string& vehicle, const std::string& subject, int level) {
+    TraceEvent event;
+    event.category = category;
+    event.vehicle = vehicle;
+    event.subject = subject;
+    event.level = level;
+    event.round = cur_round;
+    event.step = cur_step;
+    event.thread = current_thread_id();
+    event.start_us = now_us();
+
+    return event;
+}
+
+void TraceRecorder::end(TraceEvent& event) {
+    event.duration_us = now_us() - event.start_us;
+    std::lock_guard<std::mutex> lock(mutex);
+    events.push_back(event);
+}
+
+size_t TraceRecorder::size(void) {
+    std::lock_guard<std::mutex> lock(mutex);
+    return events.size();
+}
+
+SearchStats TraceRecorder::total(TraceCategory category, size_t* count) {
+    std::lock_guard<std::mutex> lock(mutex);
+    SearchStats stats;
+    size_t spans = 0;
+    for (const TraceEvent& event : events) {
+        if (event.category == category) {
+            stats += event.stats;
+            ++spans;
+        }
+    }
+    if (count != nullptr) {
+        *count = spans;
+    }
+
+    return stats;
+}
+
+bool TraceRecorder::save(const std::string& path) {
+    std::ofstream out(path);
+    if (!out) {
+        spdlog::error(fmt::format("can not open trace file {} !", path));
+        return false;
+    }
+
+    std::lock_guard<std::mutex> lock(mutex);
+    if (path.size() >= 4 && path.compare(path.size() - 4, 4, ".csv") == 0) {
+        write_csv(out);
+    } else {
+        write_chrome_trace(out);
+    }
+
+    return static_cast<bool>(out);
+}
+
+void TraceRecorder::write_chrome_trace(std::ostream& out) const {
+    // complete events ("X") nest by time on each thread, the cache rates are counters ("C")
+    out << "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [\n";
+    bool first = true;
+    for (const TraceEvent& event : events) {
+        out << (first ? "" : ",\n");
+        first = false;
+        out << fmt::format("{{\"name\": \"{}\", \"cat\": \"{}\", \"ph\": \"X\", \"ts\": {}, \"dur\": {}, "
+                           "\"pid\": 0, \"tid\": {}, \"args\": {{\"vehicle\": \"{}\", \"round\": {}, \"step\": {}",
+                           event_name(event), CATEGORY_NAMES[static_cast<int>(event.category)],
+                           event.start_us, event.duration_us, event.thread, event.vehicle, event.round, event.step);
+        if (event.category == TraceCategory::STEP) {
+            out << fmt::format(", \"cache_hits\": {}, \"cache_misses\": {}}}}}", event.cache_hits, event.cache_misses);
+            out << fmt::format(",\n{{\"name\": \"prediction cache\", \"ph\": \"C\", \"ts\": {}, \"pid\": 0, "
+                               "\"args\": {{\"hits\": {}, \"misses\": {}}}}}",
+                               event.start_us + event.duration_us, event.cache_hits, event.cache_misses);
+            continue;
+        }
+        if (event.category == TraceCategory::PLANNING || event.category == TraceCategory::SEARCH) {
+            const SearchStats& stats = event.stats;
+            out << fmt::format(", \"iterations\": {}, \"nodes_created\": {}, \"nodes_merged\": {}, "
+                               "\"rollouts\": {}, \"reward_evaluations\": {}, \"collision_checks\": {}, "
+                               "\"max_depth\": {}, \"max_width\": {}, \"tree_policy_ms\": {:.3f}, "
+                               "\"default_policy_ms\": {:.3f}, \"update_ms\": {:.3f}",
+                               stats.iterations, stats.nodes_created, stats.nodes_merged, stats.rollouts,
+                               stats.reward_evaluations, stats.collision_checks, stats.max_depth, stats.max_width,
+                               stats.tree_policy_time * 1e3, stats.default_policy_time * 1e3,
+                               stats.update_time * 1e3);
+        }
+        out << "}}";
+    }
+    out << "\n]}\n";
+}
+
+void TraceRecorder::write_csv(std::ostream& out) const {
+    out << "round,step,category,vehicle,subject,level,thread,start_us,duration_us,cached,cache_hits,cache_misses,"
+           "iterations,nodes_created,nodes_merged,rollouts,reward_evaluations,collision_checks,max_depth,max_width,"
+           "tree_policy_us,default_policy_us,update_us\n";
+    for (const TraceEvent& event : events) {
+        const SearchStats& stats = event.stats;
+        out << fmt::format("{},{},{},{},{},{},{},{},{},{:d},{},{},{},{},{},{},{},{},{},{},{:.1f},{:.1f},{:.1f}\n",
+                           event.round, event.step, CATEGORY_NAMES[static_cast<int>(event.category)],
+                           event.vehicle, event.subject, event.level, event.thread, event.start_us,
+                           event.duration_us, event.cached, event.cache_hits, event.cache_misses,
+                           stats.iterations, stats.nodes_created, stats.nodes_merged, stats.rollouts,
+                           stats.reward_evaluations, stats.collision_checks, stats.max_depth, stats.max_width,
+                           stats.tree_policy_time * 1e6, stats.default_policy_time * 1e6,
+                           stats.update_time * 1e6);
+    }
+}
@@ -0,0 +1,133 @@
+#include <cstring>
+#include <algorithm>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <spdlog/spdlog.h>
+#include <fmt/core.h>
+
+#include "trajectory_log.hpp"
+
+static const char TRAJECTORY_LOG_MAGIC[8] = {'K', 'L', 'T', 'R', 'A', 'J', '\0', '\0'};
+static const uint32_t TRAJECTORY_LOG_VERSION = 1;
+
+// copies at most `size - 1` chars, the rest of the field stays zero
+static void copy_field(char* field, size_t size, const std::string& value) {
+    std::memset(field, 0, size);
+    std::memcpy(field, value.data(), std::min(value.size(), size - 1));
+}
+
+TrajectoryLogWriter::TrajectoryLogWriter(const std::string& path, VehicleList& vehicles, int horizon_len,
+                                         double dt, int round, uint64_t seed) :
+    out(path, std::ios::binary | std::ios::trunc), horizon(std::max(horizon_len, 0)) {
+    if (!out) {
+        spdlog::error(fmt::format("can not open trajectory log {} !", path));
+        return ;
+    }
+
+    TrajectoryLogHeader header;
+    std::memset(&header, 0, sizeof(header));
+    std::memcpy(header.magic, TRAJECTORY_LOG_MAGIC, sizeof(header.magic));
+    header.version = TRAJECTORY_LOG_VERSION;
+    header.agents_num = static_cast<uint32_t>(vehicles.size());
+    header.horizon = horizon;
+    header.round = static_cast<uint32_t>(round);
+    header.seed = seed;
+    header.dt = dt;
+    out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+
+    for (std::shared_ptr<Vehicle>& vehicle : vehicles) {
+        TrajectoryLogAgent agent{};
+        copy_field(agent.name, sizeof(agent.name), vehicle->name);
+        copy_field(agent.color, sizeof(agent.color), vehicle->color);
+        agent.level = vehicle->level;
+        agent.target = vehicle->target;
+        agent.text_pos = vehicle->vis_text_pos;
+        out.write(reinterpret_cast<const char*>(&agent), sizeof(agent));
+    }
+    buffer.resize(sizeof(TrajectoryLogTick) + vehicles.size() * (sizeof(TrajectoryLogRecord) + horizon * sizeof(State)));
+}
+
+void TrajectoryLogWriter::append(int step, double simulation_time, double step_cost, uint64_t cache_hits,
+                                 uint64_t cache_misses, VehicleList& vehicles) {
+    if (!out) {
+        return ;
+    }
+
+    std::fill(buffer.begin(), buffer.end(), 0);
+    char* cursor = buffer.data();
+    TrajectoryLogTick tick;
+    std::memset(&tick, 0, sizeof(tick));
+    tick.step = static_cast<uint32_t>(step);
+    tick.simulation_time = simulation_time;
+    tick.step_cost = step_cost;
+    tick.cache_hits = static_cast<uint32_t>(cache_hits);
+    tick.cache_misses = static_cast<uint32_t>(cache_misses);
+    std::memcpy(cursor, &tick, sizeof(tick));
+    cursor += sizeof(tick);
+
+    for (std::shared_ptr<Vehicle>& vehicle : vehicles) {
+        TrajectoryLogRecord record{};
+        record.state = vehicle->state;
+        record.reached = vehicle->is_get_target();
+        const PlannedStep& planned = vehicle->last_step();
+        if (step > 0 && planned.moved) {
+            record.iterations = vehicle->planned_iterations();
+            record.action = static_cast<uint8_t>(planned.action);
+            record.moved = 1;
+            record.traj_len = static_cast<uint32_t>(std::min<size_t>(vehicle->excepted_traj.size(), horizon));
+        }
+        std::memcpy(cursor, &record, sizeof(record));
+        cursor += sizeof(record);
+        for (uint32_t pos = 0; pos < record.traj_len; ++pos) {
+            State state = vehicle->excepted_traj.at(pos);
+            std::memcpy(cursor + pos * sizeof(State), &state, sizeof(State));
+        }
+        cursor += horizon * sizeof(State);
+    }
+    out.write(buffer.data(), buffer.size());
+}
+
+TrajectoryLogReader::~TrajectoryLogReader() {
+    if (data != nullptr) {
+        munmap(const_cast<char*>(data), length);
+    }
+}
+
+bool TrajectoryLogReader::open(const std::string& path) {
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        spdlog::error(fmt::format("can not open trajectory log {} !", path));
+        return false;
+    }
+    struct stat file_stat;
+    if (fstat(fd, &file_stat) != 0 || file_stat.st_size < static_cast<off_t>(sizeof(TrajectoryLogHeader))) {
+        spdlog::error(fmt::format("{} is not a trajectory log !", path));
+        close(fd);
+        return false;
+    }
+    length = static_cast<size_t>(file_stat.st_size);
+    void* mapped = mmap(nullptr, length, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (mapped == MAP_FAILED) {
+        spdlog::error(fmt::format("can not map trajectory log {} !", path));
+        return false;
+    }
+    data = static_cast<const char*>(mapped);
+
+    const TrajectoryLogHeader& head = header();
+    size_t agents_size = head.agents_num * sizeof(TrajectoryLogAgent);
+    if (std::memcmp(head.magic, TRAJECTORY_LOG_MAGIC, sizeof(head.magic)) != 0 ||
+        head.version != TRAJECTORY_LOG_VERSION || sizeof(TrajectoryLogHeader) + agents_size > length) {
+        spdlog::error(fmt::format("{} is not a trajectory log of version {} !", path, TRAJECTORY_LOG_VERSION));
+        munmap(const_cast<char*>(data), length);
+        data = nullptr;
+        return false;
+    }
+    tick_size = sizeof(TrajectoryLogTick) + head.agents_num * (sizeof(TrajectoryLogRecord) + head.horizon * sizeof(State));
+    // a round cut short leaves a partial last tick, it is ignored
+    ticks_num = (length - sizeof(TrajectoryLogHeader) - agents_size) / tick_size;
+
+    return true;
+}
@@ -1,16 +1,16 @@
 #include <cmath>
 #include <array>
-#include <unordered_map>
+#ifdef USE_AVX2
+#include <immintrin.h>
+#endif
 
 #include <spdlog/spdlog.h>
 
 #include "utils.hpp"
 
 int Node::MAX_LEVEL = 6;
-// double (*Node::calc_value_callback)(std::shared_ptr<Node>, double) = nullptr;
-std::function<double(std::shared_ptr<Node>, double)> Node::calc_value_callback;
 
-std::default_random_engine Random::engine(std::random_device{}());
+thread_local std::default_random_engine Random::engine(std::random_device{}());
 
 constexpr std::array<const char*, 6> ACTIONNAMES = {
     "MAINTAIN",
@@ -21,6 +21,27 @@ constexpr std::array<const char*, 6> ACTIONNAMES = {
     "BRAKE"
 };
 
+static uint64_t splitmix64(uint64_t value) {
+    value += 0x9e3779b97f4a7c15ULL;
+    value = (value ^ (value >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    value = (value ^ (value >> 27)) * 0x94d049bb133111ebULL;
+    return value ^ (value >> 31);
+}
+
+void Random::seed(uint64_t _seed) {
+    // the engine keeps 32 bits, fold the high half in
+    Random::engine.seed(static_cast<unsigned int>(_seed ^ (_seed >> 32)));
+}
+
+uint64_t Random::derive(uint64_t parent, uint64_t key) {
+    return splitmix64(splitmix64(parent) ^ key);
+}
+
+uint64_t Random::draw_seed(void) {
+    std::uniform_int_distribution<uint64_t> dist;
+    return dist(Random::engine);
+}
+
 int Random::uniform(int _min, int _max) {
     std::uniform_int_distribution dist(_min, _max);
     return dist(Random::engine);
@@ -31,51 +52,129 @@ double Random::uniform(double _min, double _max) {
     return dist(Random::engine);
 }
 
-Node::Node(State _state, int _level, std::shared_ptr<Node> p,
-            Action act, StateList others, State goal) :
-            state(_state), cur_level(_level), parent(p), action(act),
-            other_agent_state(others), goal_pose(goal) {
+Node::Node(State _state, double _cos_yaw, double _sin_yaw, int _level, NodeId p,
+            Action act, const PredictionTable* others, State goal) :
+            predictions(others), parent(p), cur_level(_level), action(act),
+            state(_state), goal_pose(goal), cos_yaw(_cos_yaw), sin_yaw(_sin_yaw) {
     value = 0.0;
     reward = 0.0;
     visits = 0;
+    children = -1;
+    children_num = 0;
+    slot = 0;
+    transposition = NO_TRANSPOSITION;
 }
 
-bool Node::is_terminal(void) {
+bool Node::is_terminal(void) const {
     return cur_level >= Node::MAX_LEVEL;
 }
 
-bool Node::is_fully_expanded(void) {
-    return children.size() >= ACTION_LIST.size();
+bool Node::is_fully_expanded(void) const {
+    return children_num >= ACTION_LIST.size();
 }
 
-std::shared_ptr<Node> Node::add_child(Action next_action, double delta_t, StateList others) {
-    State new_state = utils::kinematic_propagate(state, utils::get_action_value(next_action), delta_t);
-    std::shared_ptr<Node> child = std::make_shared<Node>(
-        new_state, cur_level + 1, shared_from_this(), next_action, others, goal_pose);
-    child->actions = actions;
-    child->actions.push_back(next_action);
-    if (Node::calc_value_callback) {
-        Node::calc_value_callback(child, value);
-    } else {
-        spdlog::error("Node::calc_value_callback is null !");
+NodeId NodePool::create(State _state, int _level, NodeId p, Action act, const PredictionTable* others, State goal) {
+    return append(_state, cos(_state.yaw), sin(_state.yaw), _level, p, act, others, goal);
+}
+
+NodeId NodePool::append(State _state, double cos_yaw, double sin_yaw, int _level, NodeId p, Action act,
+                        const PredictionTable* others, State goal) {
+    nodes.emplace_back(_state, cos_yaw, sin_yaw, _level, p, act, others, goal);
+    return static_cast<NodeId>(nodes.size() - 1);
+}
+
+NodeId NodePool::add_child(NodeId parent_id, Action next_action, const State& child_state,
+                           double child_cos_yaw, double child_sin_yaw) {
+    // copy what we need first, append() may reallocate the arena
+    const PredictionTable* others = nodes[parent_id].predictions;
+    State goal_pose = nodes[parent_id].goal_pose;
+    int parent_level = nodes[parent_id].cur_level;
+
+    NodeId child_id = append(child_state, child_cos_yaw, child_sin_yaw, parent_level + 1, parent_id, next_action,
+                             others, goal_pose);
+    link_child(parent_id, child_id);
+
+    return child_id;
+}
+
+NodeId NodePool::copy_node(const Node& src, NodeId parent_id) {
+    NodeId node_id = append(src.state, src.cos_yaw, src.sin_yaw, src.cur_level, parent_id, src.action,
+                            src.predictions, src.goal_pose);
+    nodes[node_id].value = src.value;
+    if (parent_id != INVALID_NODE) {
+        link_child(parent_id, node_id);
+    }
+
+    return node_id;
+}
+
+void NodePool::link_child(NodeId parent_id, NodeId child_id) {
+    Node& parent = nodes[parent_id];
+    if (parent.children == -1) {
+        parent.children = static_cast<int32_t>(blocks.size());
+        blocks.emplace_back();
+    }
+    Node& child = nodes[child_id];
+    child.slot = static_cast<uint8_t>(parent.children_num);
+    ChildBlock& block = blocks[parent.children];
+    block.reward[child.slot] = child.reward;
+    block.visits[child.slot] = child.visits;
+    block.child[child.slot] = child_id;
+    block.transposition[child.slot] = child.transposition;
+    block.action[child.slot] = child.action;
+    ++parent.children_num;
+}
+
+size_t TranspositionKeyHash::operator()(const TranspositionKey& key) const {
+    size_t seed = std::hash<int64_t>()(key.x);
+    utils::hash_combine(seed, std::hash<int64_t>()(key.y));
+    utils::hash_combine(seed, std::hash<int64_t>()(key.yaw));
+    utils::hash_combine(seed, std::hash<int64_t>()(key.v));
+    utils::hash_combine(seed, key.level);
+
+    return seed;
+}
+
+TranspositionKey NodePool::transposition_key(const Node& node) const {
+    const State& state = node.state;
+    return TranspositionKey{static_cast<int64_t>(std::floor(state.x / transposition_cell)),
+                            static_cast<int64_t>(std::floor(state.y / transposition_cell)),
+                            static_cast<int64_t>(std::floor(utils::wrap_yaw(state.yaw) / transposition_yaw_cell)),
+                            static_cast<int64_t>(std::floor(state.v / transposition_cell)),
+                            node.cur_level};
+}
+
+const Transposition* NodePool::find_transposition(NodeId id) const {
+    if (transposition_cell <= 0) {
+        return nullptr;
     }
-    children.push_back(child);
+    auto iter = transposition_index.find(transposition_key(nodes[id]));
 
-    return child;
+    return iter != transposition_index.end() ? &transpositions[iter->second] : nullptr;
 }
 
-std::shared_ptr<Node> Node::next_node(double delta_t, StateList others) {
-    Action next_action = Random::choice(ACTION_LIST);
-    State new_state = utils::kinematic_propagate(state, utils::get_action_value(next_action), delta_t);
-    std::shared_ptr<Node> node = std::make_shared<Node>(
-        new_state, cur_level + 1, nullptr, next_action, others, goal_pose);
-    if (Node::calc_value_callback) {
-        Node::calc_value_callback(node, value);
+void NodePool::transpose(NodeId id, double reward) {
+    if (transposition_cell <= 0 || nodes[id].parent == INVALID_NODE) {
+        return ;
+    }
+    auto inserted = transposition_index.emplace(transposition_key(nodes[id]),
+                                                static_cast<int32_t>(transpositions.size()));
+    if (inserted.second) {
+        transpositions.push_back(Transposition{reward, 0.0, 0});
     } else {
-        spdlog::error("Node::calc_value_callback is null !");
+        ++merged;
     }
+    Node& node = nodes[id];
+    node.transposition = inserted.first->second;
+    blocks[nodes[node.parent].children].transposition[node.slot] = node.transposition;
+    // what the node brings along joins the state, then its slot shows the state
+    share_stats(node, node.visits, node.reward);
+}
 
-    return node;
+void NodePool::share_stats(const Node& node, int visits, double reward) {
+    Transposition& shared = transpositions[node.transposition];
+    shared.visits += visits;
+    shared.future += reward - visits * node.value;
 }
 
 namespace utils {
@@ -84,55 +183,141 @@ namespace utils {
         return ACTIONNAMES[static_cast<size_t>(action)];
     }
 
-    Eigen::Vector2d get_action_value(Action act) {
-        static std::unordered_map<Action, Eigen::Vector2d> ACTION_MAP = {
-            {Action::MAINTAIN, {0, 0}}, {Action::TURNLEFT, {0, M_PI_4}}, 
-            {Action::TURNRIGHT, {0, -M_PI_4}}, {Action::ACCELERATE, {2.5, 0}}, 
-            {Action::DECELERATE, {-2.5, 0}}, {Action::BRAKE, {-5, 0}}
-        };
+    bool has_overlap(const Eigen::Ref<const Eigen::MatrixXd>& box2d_0,
+                     const Eigen::Ref<const Eigen::MatrixXd>& box2d_1) {
+        // separating axes are the normals of every side of both polygons
+        for (int poly = 0; poly < 2; ++poly) {
+            const Eigen::Ref<const Eigen::MatrixXd>& sides = poly == 0 ? box2d_0 : box2d_1;
+            for (Eigen::Index idx = 1; idx < sides.cols(); ++idx) {
+                double axis_x = -(sides(1, idx) - sides(1, idx - 1));
+                double axis_y = sides(0, idx) - sides(0, idx - 1);
+
+                double vehicle_min = INFINITY;
+                double vehicle_max = -INFINITY;
+                for (Eigen::Index j = 0; j < box2d_0.cols(); ++j) {
+                    double project = axis_x * box2d_0(0, j) + axis_y * box2d_0(1, j);
+                    vehicle_min = std::min(vehicle_min, project);
+                    vehicle_max = std::max(vehicle_max, project);
+                }
+
+                double box2d_min = INFINITY;
+                double box2d_max = -INFINITY;
+                for (Eigen::Index j = 0; j < box2d_1.cols(); ++j) {
+                    double project = axis_x * box2d_1(0, j) + axis_y * box2d_1(1, j);
+                    box2d_min = std::min(box2d_min, project);
+                    box2d_max = std::max(box2d_max, project);
+                }
+
+                if (vehicle_min > box2d_max || box2d_min > vehicle_max) {
+                    return false;
+                }
+            }
+        }
 
-        return ACTION_MAP[act];
+        return true;
     }
 
-    bool has_overlap(Eigen::MatrixXd box2d_0, Eigen::MatrixXd box2d_1) {
-        std::vector<Eigen::Vector2d> total_sides;
-        for (size_t idx = 1; idx < box2d_0.cols(); ++idx) {
-            Eigen::Vector2d tmp = box2d_0.col(idx).head(2) - box2d_0.col(idx - 1).head(2);
-            total_sides.emplace_back(tmp);
-        }
-        for (size_t idx = 1; idx < box2d_1.cols(); ++idx) {
-            Eigen::Vector2d tmp = box2d_1.col(idx).head(2) - box2d_1.col(idx - 1).head(2);
-            total_sides.emplace_back(tmp);
-        }
+    bool has_overlap(const OrientedBox& box_0, const OrientedBox& box_1) {
+        // Two boxes only have four distinct side normals. Along an axis the
+        // boxes are separated when the projected center distance exceeds the
+        // sum of their projected half extents.
+        double dx = box_1.x - box_0.x;
+        double dy = box_1.y - box_0.y;
+        double cos_rel = std::abs(box_0.cos_yaw * box_1.cos_yaw + box_0.sin_yaw * box_1.sin_yaw);
+        double sin_rel = std::abs(box_0.sin_yaw * box_1.cos_yaw - box_0.cos_yaw * box_1.sin_yaw);
+
+        double d0 = std::abs(dx * box_0.cos_yaw + dy * box_0.sin_yaw);
+        double d1 = std::abs(-dx * box_0.sin_yaw + dy * box_0.cos_yaw);
+        double d2 = std::abs(dx * box_1.cos_yaw + dy * box_1.sin_yaw);
+        double d3 = std::abs(-dx * box_1.sin_yaw + dy * box_1.cos_yaw);
+
+        return !(d0 > box_0.half_length + box_1.half_length * cos_rel + box_1.half_width * sin_rel ||
+                 d1 > box_0.half_width + box_1.half_length * sin_rel + box_1.half_width * cos_rel ||
+                 d2 > box_1.half_length + box_0.half_length * cos_rel + box_0.half_width * sin_rel ||
+                 d3 > box_1.half_width + box_0.half_length * sin_rel + box_0.half_width * cos_rel);
+    }
 
-        for (size_t idx = 0; idx < total_sides.size(); ++idx) {
-            Eigen::Vector2d separating_axis;
-            separating_axis[0] = -total_sides[idx][1];
-            separating_axis[1] = total_sides[idx][0];
-            
-            double vehicle_min = INFINITY;
-            double vehicle_max = -INFINITY;
-            for (size_t j = 0; j < box2d_0.cols(); ++j) {
-                double project = separating_axis[0] * box2d_0(0, j) + separating_axis[1] * box2d_0(1, j);
-                vehicle_min = std::min(vehicle_min, project);
-                vehicle_max = std::max(vehicle_max, project);
+#ifdef USE_AVX2
+    // Only this kernel is built for AVX2, the rest of the binary runs on any
+    // x86-64. It tests four boxes per iteration with the arithmetic of the
+    // scalar kernel and leaves the tail of `others` to it, `tested` is the
+    // number of boxes it tested.
+    __attribute__((target("avx2")))
+    static bool has_any_overlap_avx2(const OrientedBox& box, const OrientedBox* others, size_t others_num,
+                                     size_t& tested) {
+        size_t idx = 0;
+        const __m256d sign_mask = _mm256_set1_pd(-0.0);
+        const __m256d x0 = _mm256_set1_pd(box.x);
+        const __m256d y0 = _mm256_set1_pd(box.y);
+        const __m256d hl0 = _mm256_set1_pd(box.half_length);
+        const __m256d hw0 = _mm256_set1_pd(box.half_width);
+        const __m256d c0 = _mm256_set1_pd(box.cos_yaw);
+        const __m256d s0 = _mm256_set1_pd(box.sin_yaw);
+        for (; idx + 4 <= others_num; idx += 4) {
+            const OrientedBox* b = others + idx;
+            __m256d x1 = _mm256_set_pd(b[3].x, b[2].x, b[1].x, b[0].x);
+            __m256d y1 = _mm256_set_pd(b[3].y, b[2].y, b[1].y, b[0].y);
+            __m256d hl1 = _mm256_set_pd(b[3].half_length, b[2].half_length, b[1].half_length, b[0].half_length);
+            __m256d hw1 = _mm256_set_pd(b[3].half_width, b[2].half_width, b[1].half_width, b[0].half_width);
+            __m256d c1 = _mm256_set_pd(b[3].cos_yaw, b[2].cos_yaw, b[1].cos_yaw, b[0].cos_yaw);
+            __m256d s1 = _mm256_set_pd(b[3].sin_yaw, b[2].sin_yaw, b[1].sin_yaw, b[0].sin_yaw);
+
+            __m256d dx = _mm256_sub_pd(x1, x0);
+            __m256d dy = _mm256_sub_pd(y1, y0);
+            __m256d cos_rel = _mm256_andnot_pd(sign_mask,
+                _mm256_add_pd(_mm256_mul_pd(c0, c1), _mm256_mul_pd(s0, s1)));
+            __m256d sin_rel = _mm256_andnot_pd(sign_mask,
+                _mm256_sub_pd(_mm256_mul_pd(s0, c1), _mm256_mul_pd(c0, s1)));
+
+            __m256d d0 = _mm256_andnot_pd(sign_mask, _mm256_add_pd(_mm256_mul_pd(dx, c0), _mm256_mul_pd(dy, s0)));
+            __m256d d1 = _mm256_andnot_pd(sign_mask, _mm256_sub_pd(_mm256_mul_pd(dy, c0), _mm256_mul_pd(dx, s0)));
+            __m256d d2 = _mm256_andnot_pd(sign_mask, _mm256_add_pd(_mm256_mul_pd(dx, c1), _mm256_mul_pd(dy, s1)));
+            __m256d d3 = _mm256_andnot_pd(sign_mask, _mm256_sub_pd(_mm256_mul_pd(dy, c1), _mm256_mul_pd(dx, s1)));
+
+            __m256d r0 = _mm256_add_pd(hl0, _mm256_add_pd(_mm256_mul_pd(hl1, cos_rel), _mm256_mul_pd(hw1, sin_rel)));
+            __m256d r1 = _mm256_add_pd(hw0, _mm256_add_pd(_mm256_mul_pd(hl1, sin_rel), _mm256_mul_pd(hw1, cos_rel)));
+            __m256d r2 = _mm256_add_pd(hl1, _mm256_add_pd(_mm256_mul_pd(hl0, cos_rel), _mm256_mul_pd(hw0, sin_rel)));
+            __m256d r3 = _mm256_add_pd(hw1, _mm256_add_pd(_mm256_mul_pd(hl0, sin_rel), _mm256_mul_pd(hw0, cos_rel)));
+
+            __m256d separated = _mm256_or_pd(
+                _mm256_or_pd(_mm256_cmp_pd(d0, r0, _CMP_GT_OQ), _mm256_cmp_pd(d1, r1, _CMP_GT_OQ)),
+                _mm256_or_pd(_mm256_cmp_pd(d2, r2, _CMP_GT_OQ), _mm256_cmp_pd(d3, r3, _CMP_GT_OQ)));
+            if (_mm256_movemask_pd(separated) != 0xF) {
+                tested = idx + 4;
+                return true;
             }
+        }
+        tested = idx;
 
-            double box2d_min = INFINITY;
-            double box2d_max = -INFINITY;
-            for (size_t j = 0; j < box2d_1.cols(); ++j) {
-                double project =
-                    separating_axis[0] * box2d_1(0, j) + separating_axis[1] * box2d_1(1, j);
-                box2d_min = std::min(box2d_min, project);
-                box2d_max = std::max(box2d_max, project);
-            }
+        return false;
+    }
 
-            if (vehicle_min > box2d_max || box2d_min > vehicle_max) {
-                return false;
+    // read once, a static initializer may run before the CPU model is filled in
+    static const bool CPU_HAS_AVX2 = [] {
+        __builtin_cpu_init();
+        return __builtin_cpu_supports("avx2") != 0;
+    }();
+#endif
+
+    thread_local uint64_t overlap_tests = 0;
+
+    bool has_any_overlap(const OrientedBox& box, const OrientedBox* others, size_t others_num) {
+        size_t idx = 0;
+#ifdef USE_AVX2
+        if (CPU_HAS_AVX2 && has_any_overlap_avx2(box, others, others_num, idx)) {
+            overlap_tests += idx;
+            return true;
+        }
+#endif
+        for (; idx < others_num; ++idx) {
+            if (has_overlap(box, others[idx])) {
+                overlap_tests += idx + 1;
+                return true;
             }
         }
+        overlap_tests += others_num;
 
-        return true;
+        return false;
     }
 
     State kinematic_propagate(const State& state, Eigen::Vector2d act, double dt) {
@@ -142,23 +327,26 @@ namespace utils {
 
         next_state.x = state.x + state.v * cos(state.yaw) * dt;
         next_state.y = state.y + state.v * sin(state.yaw) * dt;
-        next_state.v = state.v + acc * dt;
-        next_state.yaw = state.yaw + omega * dt;
+        next_state.v = std::min(std::max(state.v + acc * dt, -20.0), 20.0);
+        next_state.yaw = wrap_yaw(state.yaw + omega * dt);
 
-        while (next_state.yaw > 2 * M_PI) {
-            next_state.yaw -= 2 * M_PI;
-        }
-        while (next_state.yaw < 0) {
-            next_state.yaw += 2 * M_PI;
-        }
+        return next_state;
+    }
 
-        if (next_state.v > 20) {
-            next_state.v = 20;
-        } else if (next_state.v < -20) {
-            next_state.v = -20;
+    void propagate_batch(StateBatch& batch, const Action* actions, double dt) {
+        for (size_t k = 0; k < batch.size; ++k) {
+            const std::array<double, 2>& act = ACTION_VALUES[static_cast<size_t>(actions[k])];
+            batch.x[k] = batch.x[k] + batch.v[k] * batch.cos_yaw[k] * dt;
+            batch.y[k] = batch.y[k] + batch.v[k] * batch.sin_yaw[k] * dt;
+            batch.v[k] = std::min(std::max(batch.v[k] + act[0] * dt, -20.0), 20.0);
+            // only the turning actions change the heading, the others keep cos/sin
+            double yaw = wrap_yaw(batch.yaw[k] + act[1] * dt);
+            if (yaw != batch.yaw[k]) {
+                batch.yaw[k] = yaw;
+                batch.cos_yaw[k] = cos(yaw);
+                batch.sin_yaw[k] = sin(yaw);
+            }
         }
-
-        return next_state;
     }
 
     std::string absolute_path(std::string path) {
@@ -1,4 +1,5 @@
 #include <vector>
+#include <algorithm>
 #include <spdlog/spdlog.h>
 #include <matplotlib-cpp/matplotlibcpp.h>
 #include <fmt/core.h>
@@ -6,8 +7,8 @@
 
 namespace plt = matplotlibcpp;
 
-Vehicle::Vehicle(
-    std::string _name, const YAML::Node& cfg) : VehicleBase(_name) {
+Vehicle::Vehicle(std::string _name, const YAML::Node& cfg, std::shared_ptr<PlanningContext> context) :
+    VehicleBase(_name), planner(context ? context : std::make_shared<PlanningContext>(cfg)) {
     YAML::Node vehicle_info = cfg["vehicle_list"][_name];
     level = vehicle_info["level"].as<int>();
     color = vehicle_info["color"].as<std::string>();
@@ -27,40 +28,56 @@ Vehicle::Vehicle(
     vehicle_box2d = VehicleBase::get_box2d(state);
     safezone = VehicleBase::get_safezone(state);
     dt = cfg["delta_t"].as<double>();
-    planner = KLevelPlanner(cfg);
 
     reset();
 }
 
 void Vehicle::reset(void) {
-    footprint.clear();
     cur_action = Action::MAINTAIN;
     excepted_traj = StateList();
     have_got_target = false;
+    planner.reset();
 
     state.x = Random::uniform(init_x_min, init_x_max);
     state.y = Random::uniform(init_y_min, init_y_max);
     state.v = Random::uniform(init_v_min, init_v_max);
     state.yaw = init_yaw;
-    footprint.push_back(state);
+    next_step.state = state;
+    next_step.action = cur_action;
+    next_step.excepted_traj = StateList();
+    next_step.have_got_target = false;
+    next_step.moved = false;
 }
 
-void Vehicle::excute(std::vector<VehicleBase> others) {
-    if (is_get_target()) {
-        have_got_target = true;
-        state.v = 0;
-        cur_action = Action::MAINTAIN;
-        excepted_traj = StateList();
+void Vehicle::excute(const WorldSnapshot& world, int id, uint64_t seed) {
+    const State& cur_state = world.state(id);
+    if (world.is_get_target(id)) {
+        next_step.state = cur_state;
+        next_step.state.v = 0;
+        next_step.action = Action::MAINTAIN;
+        next_step.excepted_traj = StateList();
+        next_step.have_got_target = true;
+        next_step.moved = false;
     } else {
-        std::pair<Action, StateList> act_and_traj = planner.planning(*this, others);
-        cur_action = act_and_traj.first;
-        excepted_traj = act_and_traj.second;
-        state = utils::kinematic_propagate(state, utils::get_action_value(cur_action), dt);
-        footprint.push_back(state);
+        std::pair<Action, StateList> act_and_traj = planner.planning(world, id, seed);
+        next_step.action = act_and_traj.first;
+        next_step.excepted_traj = std::move(act_and_traj.second);
+        next_step.state = utils::kinematic_propagate(cur_state, utils::get_action_value(next_step.action), dt);
+        next_step.have_got_target = have_got_target;
+        next_step.moved = true;
     }
 }
 
-void Vehicle::draw_vehicle(bool fill_mode /* = false */) {
+const PlannedStep& Vehicle::commit(void) {
+    state = next_step.state;
+    cur_action = next_step.action;
+    excepted_traj = std::move(next_step.excepted_traj);
+    have_got_target = next_step.have_got_target;
+
+    return next_step;
+}
+
+void Vehicle::draw_vehicle(const State& state, const std::string& color, bool fill_mode /* = false */) {
     Eigen::Matrix<double, 2, 2, Eigen::RowMajor> head;
     Eigen::Matrix2d rot;
     head << 0.3 * VehicleBase::length, 0.3 * VehicleBase::length,
@@ -69,7 +86,7 @@ void Vehicle::draw_vehicle(bool fill_mode /* = false */) {
 
     head = rot * head;
     head += Eigen::Vector2d(state.x, state.y).replicate(1, 2);
-    vehicle_box2d = VehicleBase::get_box2d(state);
+    Eigen::Matrix<double, 2, 5, Eigen::RowMajor> vehicle_box2d = VehicleBase::get_box2d(state);
 
     std::vector<std::vector<double>> box2d_vec(2);
     std::vector<std::vector<double>> head_vec(2);
@@ -104,11 +121,19 @@ bool VehicleList::is_all_get_target(void) {
 }
 
 bool VehicleList::is_any_collision(void) {
-    for (int i = 0; i < vehicle_list.size() - 1; ++i) {
-        for (int j = i + 1; j < vehicle_list.size(); ++j) {
-            if (utils::has_overlap(
-                    VehicleBase::get_box2d(vehicle_list[i]->state),
-                    VehicleBase::get_box2d(vehicle_list[j]->state))) {
+    // sweep and prune along x, only pairs whose x extents overlap reach the exact test
+    std::vector<OrientedBox> boxes;
+    boxes.reserve(vehicle_list.size());
+    for (const std::shared_ptr<Vehicle>& vehicle : vehicle_list) {
+        boxes.push_back(VehicleBase::get_obb(vehicle->state));
+    }
+    std::sort(boxes.begin(), boxes.end(), [](const OrientedBox& a, const OrientedBox& b) {
+        return a.x - a.x_extent() < b.x - b.x_extent();
+    });
+    for (size_t i = 0; i < boxes.size(); ++i) {
+        double max_x = boxes[i].x + boxes[i].x_extent() + 1e-9;
+        for (size_t j = i + 1; j < boxes.size() && boxes[j].x - boxes[j].x_extent() <= max_x; ++j) {
+            if (utils::has_overlap(boxes[i], boxes[j])) {
                 return true;
             }
         }
@@ -125,18 +150,18 @@ void VehicleList::pop_back(void) {
     vehicle_list.pop_back();
 }
 
-std::vector<VehicleBase> VehicleList::exclude(int ego_idx) {
-    std::shared_ptr<Vehicle> ego_vehicle = vehicle_list[ego_idx];
-    return exclude(ego_vehicle);
+void VehicleList::commit(void) {
+    for (std::shared_ptr<Vehicle>& vehicle : vehicle_list) {
+        vehicle->commit();
+    }
 }
 
-std::vector<VehicleBase> VehicleList::exclude(std::shared_ptr<Vehicle> ego) {
-    std::vector<VehicleBase> exclude_list;
-    for (std::shared_ptr<Vehicle> vehicle : vehicle_list) {
-        if (vehicle->name != ego->name) {
-            exclude_list.push_back(*vehicle);
-        }
+WorldSnapshot VehicleList::snapshot(void) const {
+    std::vector<const VehicleBase*> vehicles;
+    vehicles.reserve(vehicle_list.size());
+    for (const std::shared_ptr<Vehicle>& vehicle : vehicle_list) {
+        vehicles.push_back(vehicle.get());
     }
-    
-    return exclude_list;
+
+    return WorldSnapshot(vehicles);
 }
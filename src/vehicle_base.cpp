@@ -9,10 +9,10 @@ double VehicleBase::safe_width = 2.4;
 std::shared_ptr<EnvCrossroads> VehicleBase::env = nullptr;
 
 void VehicleBase::set_target(State tar) {
-    if (tar.x >= -25 && tar.x <= 25 && tar.y >= -25 && tar.y <= 25) {
+    if (!env || env->contains(tar.x, tar.y)) {
         target = tar;
     } else {
-        spdlog::error("set_target error, the target range must >= -25 and <= 25 !");
+        spdlog::error("set_target error, the target must lie on a tile of the map !");
     }
 }
 
@@ -0,0 +1,63 @@
+#include <algorithm>
+
+#include "world.hpp"
+
+static size_t hash_agent(const VehicleBase& vehicle) {
+    std::hash<double> hasher;
+    size_t seed = std::hash<std::string>{}(vehicle.name);
+    for (double value : {vehicle.state.x, vehicle.state.y, vehicle.state.yaw, vehicle.state.v,
+                         vehicle.target.x, vehicle.target.y, vehicle.target.yaw}) {
+        utils::hash_combine(seed, hasher(value));
+    }
+    utils::hash_combine(seed, vehicle.is_get_target());
+
+    return seed;
+}
+
+WorldSnapshot::WorldSnapshot(const std::vector<const VehicleBase*>& vehicles) {
+    names.reserve(vehicles.size());
+    name_hashes.reserve(vehicles.size());
+    states.reserve(vehicles.size());
+    targets.reserve(vehicles.size());
+    levels.reserve(vehicles.size());
+    reached.reserve(vehicles.size());
+    agent_hashes.reserve(vehicles.size());
+    for (const VehicleBase* vehicle : vehicles) {
+        names.push_back(vehicle->name);
+        name_hashes.push_back(std::hash<std::string>{}(vehicle->name));
+        states.push_back(vehicle->state);
+        targets.push_back(vehicle->target);
+        levels.push_back(vehicle->level);
+        reached.push_back(vehicle->is_get_target());
+        agent_hashes.push_back(hash_agent(*vehicle));
+    }
+    sorted_hashes = agent_hashes;
+    std::sort(sorted_hashes.begin(), sorted_hashes.end());
+}
+
+static std::vector<const VehicleBase*> ego_first(const VehicleBase& ego, const std::vector<VehicleBase>& others) {
+    std::vector<const VehicleBase*> vehicles = {&ego};
+    for (const VehicleBase& other : others) {
+        vehicles.push_back(&other);
+    }
+
+    return vehicles;
+}
+
+WorldSnapshot::WorldSnapshot(const VehicleBase& ego, const std::vector<VehicleBase>& others) :
+    WorldSnapshot(ego_first(ego, others)) {}
+
+size_t WorldSnapshot::hash_from(int ego_id) const {
+    // the sorted hashes without one copy of the ego's, planners list the others in different orders
+    size_t seed = agent_hashes[ego_id];
+    bool skipped = false;
+    for (size_t agent_hash : sorted_hashes) {
+        if (!skipped && agent_hash == agent_hashes[ego_id]) {
+            skipped = true;
+            continue;
+        }
+        utils::hash_combine(seed, agent_hash);
+    }
+
+    return seed;
+}